@@ -0,0 +1,124 @@
+/* bit_volume.c - bit-packed buffers for binary volumes */
+
+#include <string.h>
+#include <volume_io.h>
+#include "bit_volume.h"
+
+/* returns a new (uninitialised) Bit_volume of the given z, y, x sizes */
+Bit_volume *new_bit_volume(int sizes[])
+{
+   Bit_volume *bvol;
+
+   bvol = (Bit_volume *) malloc(sizeof(Bit_volume));
+
+   bvol->sizes[0] = sizes[0];
+   bvol->sizes[1] = sizes[1];
+   bvol->sizes[2] = sizes[2];
+
+   bvol->row_words = (sizes[2] + BITS_PER_WORD - 1) / BITS_PER_WORD;
+   bvol->nwords = (long)sizes[0] * sizes[1] * bvol->row_words;
+   bvol->hi = bvol->lo = 0.0;
+
+   bvol->bits = (Bit_word *) malloc(bvol->nwords * sizeof(Bit_word));
+   if(bvol->bits == NULL){
+      print_error("new_bit_volume(): could not allocate %ld words\n", bvol->nwords);
+      exit(EXIT_FAILURE);
+      }
+
+   return bvol;
+   }
+
+/* returns a full copy of a Bit_volume */
+Bit_volume *copy_bit_volume(Bit_volume * bvol)
+{
+   Bit_volume *copy;
+
+   copy = new_bit_volume(bvol->sizes);
+   copy->hi = bvol->hi;
+   copy->lo = bvol->lo;
+   memcpy(copy->bits, bvol->bits, bvol->nwords * sizeof(Bit_word));
+
+   return copy;
+   }
+
+void delete_bit_volume(Bit_volume * bvol)
+{
+   free(bvol->bits);
+   free(bvol);
+   }
+
+/* pack a Raw_volume, returns NULL if it holds more than two values */
+/* the scan stops at the first third value so grey volumes are      */
+/* usually rejected after a few voxels                              */
+Bit_volume *raw_to_bits(Raw_volume * raw)
+{
+   int      b, n_values;
+   long     i, w;
+   float    values[2];
+   float   *data;
+   Bit_word word;
+   Bit_volume *bvol;
+
+   if(raw->nvox == 0){
+      return NULL;
+      }
+
+   /* find the (up to) two values */
+   values[0] = values[1] = raw->data[0];
+   n_values = 1;
+   for(i = 0; i < raw->nvox; i++){
+      if(raw->data[i] != values[0] && raw->data[i] != values[1]){
+         if(n_values == 2 || raw->data[i] != raw->data[i]){
+            return NULL;
+            }
+         values[1] = raw->data[i];
+         n_values = 2;
+         }
+      }
+
+   bvol = new_bit_volume(raw->sizes);
+   bvol->hi = (values[0] > values[1]) ? values[0] : values[1];
+   bvol->lo = (values[0] > values[1]) ? values[1] : values[0];
+
+   /* pack each row */
+   for(i = 0; i < (long)raw->sizes[0] * raw->sizes[1]; i++){
+      data = &raw->data[i * raw->sizes[2]];
+      for(w = 0; w < bvol->row_words; w++){
+         word = 0;
+         for(b = 0; b < BITS_PER_WORD && w * BITS_PER_WORD + b < raw->sizes[2]; b++){
+            if(data[w * BITS_PER_WORD + b] == bvol->hi){
+               word |= (Bit_word) 1 << b;
+               }
+            }
+         bvol->bits[i * bvol->row_words + w] = word;
+         }
+      }
+
+   return bvol;
+   }
+
+/* unpack a Bit_volume into a Raw_volume of the same size, the voxel */
+/* data is allocated if it was released while the volume was packed  */
+void bits_to_raw(Bit_volume * bvol, Raw_volume * raw)
+{
+   int      x;
+   long     i;
+   float   *data;
+   Bit_word *row;
+
+   if(raw->data == NULL){
+      raw->data = (float *)malloc(raw->nvox * sizeof(float));
+      if(raw->data == NULL){
+         print_error("bits_to_raw(): could not allocate %ld voxels\n", raw->nvox);
+         exit(EXIT_FAILURE);
+         }
+      }
+
+   for(i = 0; i < (long)raw->sizes[0] * raw->sizes[1]; i++){
+      data = &raw->data[i * raw->sizes[2]];
+      row = &bvol->bits[i * bvol->row_words];
+      for(x = 0; x < raw->sizes[2]; x++){
+         data[x] = ((row[x / BITS_PER_WORD] >> (x % BITS_PER_WORD)) & 1) ? bvol->hi : bvol->lo;
+         }
+      }
+   }
@@ -0,0 +1,45 @@
+/* bit_volume.h */
+
+#ifndef BIT_VOLUME
+#define BIT_VOLUME
+
+#include <stdint.h>
+#include "raw_volume.h"
+
+/* a word of 64 voxels along x, voxel x is bit (x % 64) of word x / 64 */
+typedef uint64_t Bit_word;
+
+#define BITS_PER_WORD 64
+
+/* Structure for a two valued volume held as packed bits      */
+/* set bits are voxels with the value hi, clear bits are lo   */
+/* each x row is padded out to a whole number of words         */
+typedef struct {
+   int      sizes[3];
+   long     row_words;
+   long     nwords;
+   Bit_word *bits;
+   float    hi;
+   float    lo;
+   } Bit_volume;
+
+/* first word of the row at z, y */
+#define BIT_ROW(bvol, z, y) \
+   (((long)(z) * (bvol)->sizes[1] + (long)(y)) * (bvol)->row_words)
+
+/* returns a new (uninitialised) Bit_volume of the given z, y, x sizes */
+Bit_volume *new_bit_volume(int sizes[]);
+
+/* returns a full copy of a Bit_volume */
+Bit_volume *copy_bit_volume(Bit_volume * bvol);
+
+/* free a Bit_volume and its bits */
+void     delete_bit_volume(Bit_volume * bvol);
+
+/* pack a Raw_volume, returns NULL if it holds more than two values */
+Bit_volume *raw_to_bits(Raw_volume * raw);
+
+/* unpack a Bit_volume into a Raw_volume of the same size */
+void     bits_to_raw(Bit_volume * bvol, Raw_volume * raw);
+
+#endif
@@ -0,0 +1,104 @@
+/* fft.c - iterative radix-2 FFT for the convolution fast path */
+
+#include <stdlib.h>
+#include <math.h>
+#include "fft.h"
+
+/* returns the smallest power of two that is at least n */
+int fft_size(int n)
+{
+   int      size;
+
+   size = 1;
+   while(size < n){
+      size *= 2;
+      }
+   return size;
+   }
+
+/* returns a plan for FFTs of length n (a power of two) */
+Fft_plan *new_fft_plan(int n)
+{
+   Fft_plan *plan;
+   int      i, j, bits;
+
+   plan = (Fft_plan *) malloc(sizeof(Fft_plan));
+   plan->n = n;
+   plan->bitrev = (int *)malloc(n * sizeof(int));
+   plan->twiddle = (double *)malloc((n / 2 + 1) * 2 * sizeof(double));
+
+   bits = 0;
+   while((1 << bits) < n){
+      bits++;
+      }
+   for(i = 0; i < n; i++){
+      plan->bitrev[i] = 0;
+      for(j = 0; j < bits; j++){
+         if(i & (1 << j)){
+            plan->bitrev[i] |= 1 << (bits - 1 - j);
+            }
+         }
+      }
+
+   /* the twiddles are worked out directly rather than by a recurrence */
+   for(i = 0; i < n / 2; i++){
+      plan->twiddle[2 * i] = cos(2.0 * M_PI * i / n);
+      plan->twiddle[2 * i + 1] = -sin(2.0 * M_PI * i / n);
+      }
+
+   return plan;
+   }
+
+/* free a plan */
+void delete_fft_plan(Fft_plan * plan)
+{
+   free(plan->bitrev);
+   free(plan->twiddle);
+   free(plan);
+   }
+
+/* in-place forward (or unscaled inverse) transform of n contiguous */
+/* complex values, the plan can be shared by several threads        */
+void fft(Fft_plan * plan, double *data, int inverse)
+{
+   int      n = plan->n;
+   int      i, j, k, len, half, step;
+   double   wr, wi, tr, ti, tmp;
+   double  *a, *b;
+
+   /* reorder the input */
+   for(i = 0; i < n; i++){
+      j = plan->bitrev[i];
+      if(j > i){
+         tmp = data[2 * i];
+         data[2 * i] = data[2 * j];
+         data[2 * j] = tmp;
+         tmp = data[2 * i + 1];
+         data[2 * i + 1] = data[2 * j + 1];
+         data[2 * j + 1] = tmp;
+         }
+      }
+
+   /* then the butterflies, doubling the length each time */
+   for(len = 2; len <= n; len *= 2){
+      half = len / 2;
+      step = n / len;
+      for(i = 0; i < n; i += len){
+         for(k = 0; k < half; k++){
+            wr = plan->twiddle[2 * k * step];
+            wi = plan->twiddle[2 * k * step + 1];
+            if(inverse){
+               wi = -wi;
+               }
+            a = &data[2 * (i + k)];
+            b = &data[2 * (i + k + half)];
+            tr = b[0] * wr - b[1] * wi;
+            ti = b[0] * wi + b[1] * wr;
+            b[0] = a[0] - tr;
+            b[1] = a[1] - ti;
+            a[0] += tr;
+            a[1] += ti;
+            }
+         }
+      }
+   }
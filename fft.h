@@ -0,0 +1,27 @@
+/* fft.h */
+
+#ifndef FFT
+#define FFT
+
+/* a radix-2 complex FFT of a fixed length, complex values are */
+/* stored as interleaved (real, imaginary) pairs of doubles     */
+typedef struct {
+   int      n;
+   int     *bitrev;                    /* index of each input after reordering */
+   double  *twiddle;                   /* exp(-2 pi i k / n) for k < n / 2 */
+   } Fft_plan;
+
+/* returns the smallest power of two that is at least n */
+int      fft_size(int n);
+
+/* returns a plan for FFTs of length n (a power of two) */
+Fft_plan *new_fft_plan(int n);
+
+/* free a plan */
+void     delete_fft_plan(Fft_plan * plan);
+
+/* in-place forward (or unscaled inverse) transform of n contiguous */
+/* complex values, the plan can be shared by several threads        */
+void     fft(Fft_plan * plan, double *data, int inverse);
+
+#endif
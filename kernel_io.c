@@ -1,5 +1,6 @@
 /* kernel_io.c - reads kernel files */
 
+#include <string.h>
 #include <volume_io.h>
 #include "kernel_io.h"
 #define MAX_KERNEL_ELEMS 10000
@@ -35,6 +36,14 @@ Kernel  *new_kernel(int nelems)
       }
    tmp->nelems = nelems;
 
+   tmp->offsets = NULL;
+   tmp->dx = tmp->dy = tmp->dz = NULL;
+   tmp->coeffs = NULL;
+   tmp->unit_coeffs = FALSE;
+
+   tmp->n_factors = 0;
+   tmp->factors = NULL;
+
    return tmp;
    }
 
@@ -198,6 +207,356 @@ int setup_pad_values(Kernel * kernel)
    return (TRUE);
    }
 
+/* small factors tried by decompose_kernel() as (z, y, x) steps, */
+/* each includes the centre and they are tried in this order      */
+typedef struct {
+   int      n;
+   int      d[7][3];
+   } Factor_def;
+
+static const Factor_def factor_defs[] = {
+   {7, {{0, 0, 0}, {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}}},
+   {5, {{0, 0, 0}, {0, -1, 0}, {0, 1, 0}, {0, 0, -1}, {0, 0, 1}}},
+   {5, {{0, 0, 0}, {-1, 0, 0}, {1, 0, 0}, {0, 0, -1}, {0, 0, 1}}},
+   {5, {{0, 0, 0}, {-1, 0, 0}, {1, 0, 0}, {0, -1, 0}, {0, 1, 0}}},
+   {3, {{0, 0, 0}, {0, 0, -1}, {0, 0, 1}}},
+   {3, {{0, 0, 0}, {0, -1, 0}, {0, 1, 0}}},
+   {3, {{0, 0, 0}, {-1, 0, 0}, {1, 0, 0}}},
+   {2, {{0, 0, 0}, {0, 0, 1}}},
+   {2, {{0, 0, 0}, {0, 0, -1}}},
+   {2, {{0, 0, 0}, {0, 1, 0}}},
+   {2, {{0, 0, 0}, {0, -1, 0}}},
+   {2, {{0, 0, 0}, {1, 0, 0}}},
+   {2, {{0, 0, 0}, {-1, 0, 0}}}
+   };
+
+#define N_FACTOR_DEFS (sizeof(factor_defs) / sizeof(factor_defs[0]))
+
+/* index of (z, y, x) in a grid of the given extent or -1 if outside */
+static long grid_index(int ext[], int z, int y, int x)
+{
+   if(z < 0 || z >= ext[0] || y < 0 || y >= ext[1] || x < 0 || x >= ext[2]){
+      return -1;
+      }
+   return ((long)z * ext[1] + y) * ext[2] + x;
+   }
+
+/* binary erosion (is_max FALSE) or dilation of a kernel grid by a factor */
+static int grid_morph(char *in, char *out, int ext[], const Factor_def * f, int is_max)
+{
+   int      x, y, z, c, count;
+   long     idx, nidx;
+
+   count = 0;
+   for(z = 0; z < ext[0]; z++){
+      for(y = 0; y < ext[1]; y++){
+         for(x = 0; x < ext[2]; x++){
+            idx = grid_index(ext, z, y, x);
+            out[idx] = !is_max;
+            for(c = 0; c < f->n; c++){
+               if(is_max){
+                  nidx = grid_index(ext, z - f->d[c][0], y - f->d[c][1], x - f->d[c][2]);
+                  if(nidx >= 0 && in[nidx]){
+                     out[idx] = TRUE;
+                     break;
+                     }
+                  }
+               else {
+                  nidx = grid_index(ext, z + f->d[c][0], y + f->d[c][1], x + f->d[c][2]);
+                  if(nidx < 0 || !in[nidx]){
+                     out[idx] = FALSE;
+                     break;
+                     }
+                  }
+               }
+            count += out[idx];
+            }
+         }
+      }
+   return count;
+   }
+
+/* make a flat factor kernel from the set points of a grid */
+static Kernel *grid_to_kernel(char *grid, int ext[], int b0[])
+{
+   int      x, y, z, c;
+   long     i;
+   Kernel  *factor;
+
+   c = 0;
+   for(i = 0; i < (long)ext[0] * ext[1] * ext[2]; i++){
+      c += grid[i];
+      }
+
+   factor = new_kernel(c - 1);
+   c = 0;
+   for(z = 0; z < ext[0]; z++){
+      for(y = 0; y < ext[1]; y++){
+         for(x = 0; x < ext[2]; x++){
+            if(!grid[grid_index(ext, z, y, x)] ||
+               (z + b0[0] == 0 && y + b0[1] == 0 && x + b0[2] == 0)){
+               continue;
+               }
+            factor->K[c][0] = x + b0[2];
+            factor->K[c][1] = y + b0[1];
+            factor->K[c][2] = z + b0[0];
+            c++;
+            }
+         }
+      }
+   setup_pad_values(factor);
+
+   return factor;
+   }
+
+/* free the factor chain of a kernel, factors own their element rows */
+static void delete_factors(Kernel * kernel)
+{
+   int      f, c;
+
+   for(f = 0; f < kernel->n_factors; f++){
+      for(c = 0; c < kernel->factors[f]->nelems; c++){
+         FREE(kernel->factors[f]->K[c]);
+         }
+      delete_kernel(kernel->factors[f]);
+      }
+   if(kernel->factors != NULL){
+      FREE(kernel->factors);
+      }
+   kernel->n_factors = 0;
+   kernel->factors = NULL;
+   }
+
+/* split a flat kernel (plus its centre) into a Minkowski sum of small */
+/* factors, the lines are merged into a single box and whatever can't */
+/* be split is left as a final factor.  The chain is only kept if it   */
+/* is cheaper than using the kernel directly (see morph_kernel)         */
+int decompose_kernel(Kernel * kernel)
+{
+   int      c, n, f, count, new_count, cost;
+   int      b0[3], b1[3], ext[3], box0[3], box1[3];
+   int      used[N_FACTOR_DEFS];
+   int      found, is_line, axis;
+   long     size;
+   char    *grid, *eroded, *dilated, *tmp;
+
+   delete_factors(kernel);
+
+   /* only flat 3D kernels with integer offsets */
+   for(c = 0; c < kernel->nelems; c++){
+      if(kernel->K[c][3] != 0.0 || kernel->K[c][4] != 0.0 || kernel->K[c][5] != 1.0){
+         return FALSE;
+         }
+      for(n = 0; n < 3; n++){
+         if(kernel->K[c][n] != (int)kernel->K[c][n]){
+            return FALSE;
+            }
+         }
+      }
+
+   size = 1;
+   for(n = 0; n < 3; n++){
+      b0[n] = kernel->pre_pad[2 - n];
+      b1[n] = kernel->post_pad[2 - n];
+      ext[n] = b1[n] - b0[n] + 1;
+      size *= ext[n];
+      }
+
+   grid = (char *)calloc(size, sizeof(char));
+   eroded = (char *)calloc(size, sizeof(char));
+   dilated = (char *)calloc(size, sizeof(char));
+   grid[grid_index(ext, -b0[0], -b0[1], -b0[2])] = TRUE;
+   for(c = 0; c < kernel->nelems; c++){
+      grid[grid_index(ext, (int)kernel->K[c][2] - b0[0], (int)kernel->K[c][1] - b0[1],
+                      (int)kernel->K[c][0] - b0[2])] = TRUE;
+      }
+   count = 0;
+   for(size--; size >= 0; size--){
+      count += grid[size];
+      }
+
+   /* greedily peel off factors while the rest dilated by the */
+   /* factor gives back exactly what we had                   */
+   for(f = 0; f < N_FACTOR_DEFS; f++){
+      used[f] = 0;
+      }
+   found = TRUE;
+   while(found && count > 1){
+      found = FALSE;
+      for(f = 0; f < N_FACTOR_DEFS && !found; f++){
+         new_count = grid_morph(grid, eroded, ext, &factor_defs[f], FALSE);
+         if(new_count == 0 || new_count >= count ||
+            !eroded[grid_index(ext, -b0[0], -b0[1], -b0[2])]){
+            continue;
+            }
+         if(grid_morph(eroded, dilated, ext, &factor_defs[f], TRUE) != count ||
+            memcmp(grid, dilated, ext[0] * ext[1] * ext[2]) != 0){
+            continue;
+            }
+
+         used[f]++;
+         count = new_count;
+         tmp = grid;
+         grid = eroded;
+         eroded = tmp;
+         found = TRUE;
+         }
+      }
+
+   /* merge the lines into one box and estimate the cost per voxel, */
+   /* about 4 operations per van Herk/Gil-Werman line pass plus the */
+   /* masking and final combination                                 */
+   for(n = 0; n < 3; n++){
+      box0[n] = box1[n] = 0;
+      }
+   cost = 2;
+   for(f = 0; f < N_FACTOR_DEFS; f++){
+      is_line = (factor_defs[f].n <= 3);
+      for(c = 0; c < used[f]; c++){
+         if(is_line){
+            for(n = 1; n < factor_defs[f].n; n++){
+               for(axis = 0; axis < 3; axis++){
+                  if(factor_defs[f].d[n][axis] < 0){
+                     box0[axis]--;
+                     }
+                  if(factor_defs[f].d[n][axis] > 0){
+                     box1[axis]++;
+                     }
+                  }
+               }
+            }
+         else {
+            cost += factor_defs[f].n - 1;
+            }
+         }
+      }
+   for(n = 0; n < 3; n++){
+      if(box1[n] > box0[n]){
+         cost += 4;
+         }
+      }
+   if(count > 1){
+      cost += count - 1;
+      }
+
+   if(cost < kernel->nelems){
+      ALLOC(kernel->factors, N_FACTOR_DEFS + 2);
+
+      /* the box of lines */
+      if(box1[0] > box0[0] || box1[1] > box0[1] || box1[2] > box0[2]){
+         for(n = 0; n < 3; n++){
+            ext[n] = box1[n] - box0[n] + 1;
+            }
+         tmp = (char *)malloc(ext[0] * ext[1] * ext[2] * sizeof(char));
+         memset(tmp, TRUE, ext[0] * ext[1] * ext[2]);
+         kernel->factors[kernel->n_factors++] = grid_to_kernel(tmp, ext, box0);
+         free(tmp);
+         }
+
+      /* the crosses */
+      for(f = 0; f < N_FACTOR_DEFS; f++){
+         if(factor_defs[f].n <= 3){
+            continue;
+            }
+         for(n = 0; n < 3; n++){
+            box0[n] = -1;
+            ext[n] = 3;
+            }
+         tmp = (char *)calloc(27, sizeof(char));
+         for(n = 0; n < factor_defs[f].n; n++){
+            tmp[grid_index(ext, factor_defs[f].d[n][0] + 1, factor_defs[f].d[n][1] + 1,
+                           factor_defs[f].d[n][2] + 1)] = TRUE;
+            }
+         for(c = 0; c < used[f]; c++){
+            kernel->factors[kernel->n_factors++] = grid_to_kernel(tmp, ext, box0);
+            }
+         free(tmp);
+         }
+
+      /* and the remainder */
+      if(count > 1){
+         for(n = 0; n < 3; n++){
+            ext[n] = b1[n] - b0[n] + 1;
+            }
+         kernel->factors[kernel->n_factors++] = grid_to_kernel(grid, ext, b0);
+         }
+
+      if(verbose){
+         fprintf(stdout, "Kernel decomposed into %d factors:", kernel->n_factors);
+         for(f = 0; f < kernel->n_factors; f++){
+            fprintf(stdout, " %dx%dx%d/%d",
+                    kernel->factors[f]->post_pad[0] - kernel->factors[f]->pre_pad[0] + 1,
+                    kernel->factors[f]->post_pad[1] - kernel->factors[f]->pre_pad[1] + 1,
+                    kernel->factors[f]->post_pad[2] - kernel->factors[f]->pre_pad[2] + 1,
+                    kernel->factors[f]->nelems + 1);
+            }
+         fprintf(stdout, "\n");
+         }
+      }
+
+   free(grid);
+   free(eroded);
+   free(dilated);
+
+   return (kernel->n_factors > 0);
+   }
+
+/* convert the kernel elements into linear voxel offsets for a  */
+/* volume with the given z, y, x strides plus a coefficient array */
+/* the t and v dimensions are ignored as volumes are only 3D      */
+int compile_kernel(Kernel * kernel, long strides[])
+{
+   int      c;
+
+   if(kernel->offsets != NULL){
+      FREE(kernel->offsets);
+      FREE(kernel->dx);
+      FREE(kernel->dy);
+      FREE(kernel->dz);
+      FREE(kernel->coeffs);
+      }
+   ALLOC(kernel->offsets, kernel->nelems + 1);
+   ALLOC(kernel->dx, kernel->nelems + 1);
+   ALLOC(kernel->dy, kernel->nelems + 1);
+   ALLOC(kernel->dz, kernel->nelems + 1);
+   ALLOC(kernel->coeffs, kernel->nelems + 1);
+
+   kernel->unit_coeffs = TRUE;
+   for(c = 0; c < kernel->nelems; c++){
+      kernel->dx[c] = (int)kernel->K[c][0];
+      kernel->dy[c] = (int)kernel->K[c][1];
+      kernel->dz[c] = (int)kernel->K[c][2];
+      kernel->offsets[c] = kernel->dz[c] * strides[0] +
+         kernel->dy[c] * strides[1] + kernel->dx[c] * strides[2];
+      kernel->coeffs[c] = kernel->K[c][5];
+
+      if(kernel->coeffs[c] != 1.0){
+         kernel->unit_coeffs = FALSE;
+         }
+      }
+
+   for(c = 0; c < kernel->n_factors; c++){
+      compile_kernel(kernel->factors[c], strides);
+      }
+
+   return (TRUE);
+   }
+
+/* free a kernel and its compiled form, the element rows */
+/* are left alone as split kernels share them            */
+void delete_kernel(Kernel * kernel)
+{
+   if(kernel->offsets != NULL){
+      FREE(kernel->offsets);
+      FREE(kernel->dx);
+      FREE(kernel->dy);
+      FREE(kernel->dz);
+      FREE(kernel->coeffs);
+      }
+   delete_factors(kernel);
+   free(kernel);
+   }
+
 /* 2D 4 connectivity kernel                              */
 /*            x       y       z       t       v   coeff  */
 /*      -----------------------------------------------  */
@@ -14,11 +14,21 @@ typedef enum {
    } kern_types;
 
 /* Structure for Kernel information */
-typedef struct {
+typedef struct kernel_struct {
    int      nelems;
    int      pre_pad[KERNEL_DIMS];
    int      post_pad[KERNEL_DIMS];
    VIO_Real   **K;
+
+   /* compiled form of K for a given set of volume strides */
+   int     *offsets;
+   int     *dx, *dy, *dz;
+   VIO_Real *coeffs;
+   int      unit_coeffs;
+
+   /* equivalent chain of smaller flat kernels (see decompose_kernel) */
+   int      n_factors;
+   struct kernel_struct **factors;
    } Kernel;
 
 /* returns a new B_Matrix struct (pointer) */
@@ -33,6 +43,15 @@ int      print_kernel(Kernel * kernel);
 /* calculate start and step offsets for this kernel */
 int      setup_pad_values(Kernel * kernel);
 
+/* split a flat kernel into a cheaper chain of line and small kernels */
+int      decompose_kernel(Kernel * kernel);
+
+/* convert the kernel elements to linear offsets for the z, y, x strides */
+int      compile_kernel(Kernel * kernel, long strides[]);
+
+/* free a kernel (the element rows may be shared with split kernels) */
+void     delete_kernel(Kernel * kernel);
+
 /* return the default kernel(s) */
 Kernel  *get_2D04_kernel(void);
 Kernel  *get_2D08_kernel(void);
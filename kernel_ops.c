@@ -2,13 +2,43 @@
 
 #include <float.h>
 #include <limits.h>
+#include <string.h>
 #include "kernel_ops.h"
+#include "threads.h"
+#include "row_ops.h"
+#include "fft.h"
 
 extern int verbose;
 
+/* kernels up to this size are median filtered with a sorting */
+/* network, MEDIAN_BLOCK voxels of a row at a time             */
+#define MEDIAN_NETWORK_MAX 64
+#define MEDIAN_BLOCK 256
+
+/* the rank filter keeps a histogram of integer data with up to */
+/* HIST_MAX_BINS values, searched HIST_COARSE bins at a time     */
+#define HIST_MAX_BINS 65536
+#define HIST_COARSE 256
+
+/* an active front step that would redo more than 1 / FRONT_DENSE */
+/* of the volume is done as a full pass instead                   */
+#define FRONT_DENSE 8
+
+/* running sums kept for a box local correlation, a*a, b*b, a*b and */
+/* the counts of non-zero a and b                                   */
+#define LCORR_SUMS 5
+
+/* an FFT convolution tile holds at most FFT_TILE_MAX complex values, */
+/* FFT_COST is the cost of a butterfly per value and pass relative to */
+/* the multiply and add of a direct convolution                       */
+#define FFT_TILE_MAX (1 << 23)
+#define FFT_COST 14.0
+
+/* point operations are done POINT_BLOCK voxels of a slice at a time */
+#define POINT_BLOCK 4096
+
 /* function prototypes */
 void     split_kernel(Kernel * K, Kernel * k1, Kernel * k2);
-int      compare_ints(const void *a, const void *b);
 int      compare_groups(const void *a, const void *b);
 
 /* structure for group information */
@@ -19,24 +49,18 @@ typedef struct {
 
 typedef group_info_struct *Group_info;
 
-int compare_ints(const void *a, const void *b)
-{
-   return (*(int *)a - *(int *)b);
-   }
-
+/* larger groups first, equal sized groups in the order they were found */
 int compare_groups(const void *a, const void *b)
 {
-   return (*(Group_info *) b)->count - (*(Group_info *) a)->count;
+   Group_info ga = (Group_info) a;
+   Group_info gb = (Group_info) b;
+
+   if(ga->count != gb->count){
+      return (ga->count < gb->count) ? 1 : -1;
+      }
+   return (ga->orig_label > gb->orig_label) - (ga->orig_label < gb->orig_label);
    }
 
-int compare_reals(const void* a, const void* b)
-{
-   return (*(Real *)a - *(Real *)b);
-}
-int compare_unsigned_ints(const void* a, const void* b)
-{
-   return (*(unsigned int *)a - *(unsigned int *)b);
-}
 
 void split_kernel(Kernel * K, Kernel * k1, Kernel * k2)
 {
@@ -61,88 +85,195 @@ void split_kernel(Kernel * K, Kernel * k1, Kernel * k2)
    k2->nelems = k2c;
    }
 
-/* binarise a volume between a range */
-Volume  *binarise(Volume * vol, double floor, double ceil, double fg, double bg)
+/* structure for the arguments of the point operation passes */
+typedef struct {
+   Raw_volume *vol;
+   Point_op *ops;
+   int      n_ops;
+   double  *min;                       /* range of the result per thread */
+   double  *max;
+   progress_struct *progress;
+   } point_args_struct;
+
+/* the point operations over the z-slab [start, stop), a block of a */
+/* slice at a time so each op is a simple loop over voxels in cache */
+static void point_slab(void *arg, int start, int stop, int thread)
 {
-   int      x, y, z;
-   int      sizes[MAX_VAR_DIMS];
-   double   value;
-   progress_struct progress;
-
-   if(verbose){
-      fprintf(stdout, "Binarising, range: [%g:%g] fg/bg: [%g:%g]\n", floor, ceil, fg, bg);
-      }
-   get_volume_sizes(*vol, sizes);
+   point_args_struct *args = (point_args_struct *) arg;
+   Point_op *op;
+   int      z, c;
+   long     i, b, n, slice;
+   double   lo, hi, min, max;
+   float    fg, bg;
+   float   *data;
+
+   slice = args->vol->strides[0];
+   min = DBL_MAX;
+   max = -DBL_MAX;
+
+   for(z = start; z < stop; z++){
+      for(b = 0; b < slice; b += POINT_BLOCK){
+         data = &args->vol->data[z * slice + b];
+         n = (b + POINT_BLOCK < slice) ? POINT_BLOCK : slice - b;
+
+         for(c = 0; c < args->n_ops; c++){
+            op = &args->ops[c];
+            lo = op->range[0];
+            hi = op->range[1];
+            fg = op->fg;
+            bg = op->bg;
+            switch (op->type){
+            case POINT_BINARISE:
+               for(i = 0; i < n; i++){
+                  data[i] = (data[i] >= lo && data[i] <= hi) ? fg : bg;
+                  }
+               break;
 
-   initialize_progress_report(&progress, FALSE, sizes[2], "Binarise");
-   for(z = sizes[0]; z--;){
-      for(y = sizes[1]; y--;){
-         for(x = sizes[2]; x--;){
+            case POINT_CLAMP:
+               for(i = 0; i < n; i++){
+                  data[i] = (data[i] < lo || data[i] > hi) ? bg : data[i];
+                  }
+               break;
+               }
+            }
 
-            value = get_volume_voxel_value(*vol, z, y, x, 0, 0);
-            if((value >= floor) && (value <= ceil)){
-               set_volume_voxel_value(*vol, z, y, x, 0, 0, fg);
+         for(i = 0; i < n; i++){
+            if(data[i] < min){
+               min = data[i];
                }
-            else {
-               set_volume_voxel_value(*vol, z, y, x, 0, 0, bg);
+            if(data[i] > max){
+               max = data[i];
                }
-
             }
          }
-      update_progress_report(&progress, z + 1);
+
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
       }
-   terminate_progress_report(&progress);
 
-   return (vol);
+   args->min[thread] = min;
+   args->max[thread] = max;
    }
 
-/* clamp a volume between a range */
-Volume  *clamp(Volume * vol, double floor, double ceil, double bg)
+/* apply a list of point operations in a single pass over the volume, */
+/* if min and max are not NULL they are set to the range of the result */
+Raw_volume *point_kernel(Raw_volume * vol, Point_op ops[], int n, double *min, double *max)
 {
-   int      x, y, z;
-   int      sizes[MAX_VAR_DIMS];
-   double   value;
+   int      c, t;
+   point_args_struct args;
    progress_struct progress;
 
    if(verbose){
-      fprintf(stdout, "Clamping, range: [%g:%g] bg: %g\n", floor, ceil, bg);
+      for(c = 0; c < n; c++){
+         if(ops[c].type == POINT_BINARISE){
+            fprintf(stdout, "Binarising, range: [%g:%g] fg/bg: [%g:%g]\n", ops[c].range[0],
+                    ops[c].range[1], ops[c].fg, ops[c].bg);
+            }
+         else {
+            fprintf(stdout, "Clamping, range: [%g:%g] bg: %g\n", ops[c].range[0],
+                    ops[c].range[1], ops[c].bg);
+            }
+         }
       }
 
-   get_volume_sizes(*vol, sizes);
+   args.vol = vol;
+   args.ops = ops;
+   args.n_ops = n;
+   args.progress = &progress;
+   ALLOC(args.min, n_threads);
+   ALLOC(args.max, n_threads);
+   for(t = 0; t < n_threads; t++){
+      args.min[t] = DBL_MAX;
+      args.max[t] = -DBL_MAX;
+      }
 
-   initialize_progress_report(&progress, FALSE, sizes[2], "Clamping");
-   for(z = sizes[0]; z--;){
-      for(y = sizes[1]; y--;){
-         for(x = sizes[2]; x--;){
-            value = get_volume_voxel_value(*vol, z, y, x, 0, 0);
-            if((value < floor) || (value > ceil)){
-               set_volume_voxel_value(*vol, z, y, x, 0, 0, bg);
-               }
+   initialize_progress_report(&progress, FALSE, vol->sizes[0],
+                              (n > 1) ? "Point Ops" : (ops[0].type == POINT_BINARISE) ?
+                              "Binarise" : "Clamping");
+   run_slabs(point_slab, &args, 0, vol->sizes[0]);
+   terminate_progress_report(&progress);
+
+   if(min != NULL && max != NULL){
+      *min = DBL_MAX;
+      *max = -DBL_MAX;
+      for(t = 0; t < n_threads; t++){
+         if(args.min[t] < *min){
+            *min = args.min[t];
+            }
+         if(args.max[t] > *max){
+            *max = args.max[t];
             }
          }
-      update_progress_report(&progress, z + 1);
       }
 
-   terminate_progress_report(&progress);
+   FREE(args.min);
+   FREE(args.max);
    return (vol);
    }
 
+/* the result of a list of point operations on a single value, */
+/* kept in a float as it would be in the volume                 */
+double point_value(Point_op ops[], int n, double value)
+{
+   int      c;
+   float    v = (float)value;
+
+   for(c = 0; c < n; c++){
+      switch (ops[c].type){
+      case POINT_BINARISE:
+         v = (v >= ops[c].range[0] && v <= ops[c].range[1]) ? (float)ops[c].fg :
+            (float)ops[c].bg;
+         break;
+
+      case POINT_CLAMP:
+         v = (v < ops[c].range[0] || v > ops[c].range[1]) ? (float)ops[c].bg : v;
+         break;
+         }
+      }
+
+   return v;
+   }
+
+/* binarise a volume between a range */
+Raw_volume *binarise(Raw_volume * vol, double floor, double ceil, double fg, double bg)
+{
+   Point_op op;
+
+   op.type = POINT_BINARISE;
+   op.range[0] = floor;
+   op.range[1] = ceil;
+   op.fg = fg;
+   op.bg = bg;
+   return (point_kernel(vol, &op, 1, NULL, NULL));
+   }
+
+/* clamp a volume between a range */
+Raw_volume *clamp(Raw_volume * vol, double floor, double ceil, double bg)
+{
+   Point_op op;
+
+   op.type = POINT_CLAMP;
+   op.range[0] = floor;
+   op.range[1] = ceil;
+   op.bg = bg;
+   return (point_kernel(vol, &op, 1, NULL, NULL));
+   }
+
 /* pad a volume using the background value */
-Volume  *pad(Kernel * K, Volume * vol, double bg)
+Raw_volume *pad(Kernel * K, Raw_volume * vol, double bg)
 {
    int      x, y, z;
-   int      sizes[MAX_VAR_DIMS];
-
-   get_volume_sizes(*vol, sizes);
+   int     *sizes = vol->sizes;
 
    /* z */
    for(y = 0; y < sizes[1]; y++){
       for(x = 0; x < sizes[2]; x++){
          for(z = 0; z < -K->pre_pad[2]; z++){
-            set_volume_real_value(*vol, z, y, x, 0, 0, bg);
+            vol->data[RAW_INDEX(vol, z, y, x)] = bg;
             }
          for(z = sizes[0] - K->post_pad[2]; z < sizes[0]; z++){
-            set_volume_real_value(*vol, z, y, x, 0, 0, bg);
+            vol->data[RAW_INDEX(vol, z, y, x)] = bg;
             }
          }
       }
@@ -151,10 +282,10 @@ Volume  *pad(Kernel * K, Volume * vol, double bg)
    for(z = 0; z < sizes[0]; z++){
       for(x = 0; x < sizes[2]; x++){
          for(y = 0; y < -K->pre_pad[1]; y++){
-            set_volume_real_value(*vol, z, y, x, 0, 0, bg);
+            vol->data[RAW_INDEX(vol, z, y, x)] = bg;
             }
          for(y = sizes[1] - K->post_pad[1]; y < sizes[1]; y++){
-            set_volume_real_value(*vol, z, y, x, 0, 0, bg);
+            vol->data[RAW_INDEX(vol, z, y, x)] = bg;
             }
          }
       }
@@ -163,10 +294,10 @@ Volume  *pad(Kernel * K, Volume * vol, double bg)
    for(z = 0; z < sizes[0]; z++){
       for(y = 0; y < sizes[1]; y++){
          for(x = 0; x < -K->pre_pad[0]; x++){
-            set_volume_real_value(*vol, z, y, x, 0, 0, bg);
+            vol->data[RAW_INDEX(vol, z, y, x)] = bg;
             }
          for(x = sizes[2] - K->post_pad[0]; x < sizes[2]; x++){
-            set_volume_real_value(*vol, z, y, x, 0, 0, bg);
+            vol->data[RAW_INDEX(vol, z, y, x)] = bg;
             }
          }
       }
@@ -174,385 +305,3232 @@ Volume  *pad(Kernel * K, Volume * vol, double bg)
    return (vol);
    }
 
-/* perform a dilation on a volume */
-Volume  *dilation_kernel(Kernel * K, Volume * vol)
+/* copy the voxels of src outside the range a kernel is applied */
+/* over to dst, for ops that only write inside that range       */
+static void copy_padding(Kernel * K, Raw_volume * src, Raw_volume * dst)
 {
-   int      x, y, z, c;
-   double   value;
-   int      sizes[MAX_VAR_DIMS];
-   progress_struct progress;
-   Volume   tmp_vol;
-
-   if(verbose){
-      fprintf(stdout, "Dilation kernel\n");
+   int      y, z, n;
+   int      lo[3], hi[3];
+   int     *sizes = src->sizes;
+   long     row;
+
+   for(n = 0; n < 3; n++){
+      lo[n] = -K->pre_pad[2 - n];
+      hi[n] = sizes[n] - K->post_pad[2 - n];
+      if(lo[n] > sizes[n]){
+         lo[n] = sizes[n];
+         }
+      if(hi[n] < lo[n]){
+         hi[n] = lo[n];
+         }
       }
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Dilation");
 
-   /* copy the volume */
-   tmp_vol = copy_volume(*vol);
-
-   for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
-      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
-         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
-
-            value = get_volume_real_value(tmp_vol, z, y, x, 0, 0);
-            for(c = 0; c < K->nelems; c++){
-               if(get_volume_real_value(*vol,
-                                        z + K->K[c][2],
-                                        y + K->K[c][1],
-                                        x + K->K[c][0],
-                                        0 + K->K[c][3], 0 + K->K[c][4]) < value){
-                  set_volume_real_value(*vol,
-                                        z + K->K[c][2],
-                                        y + K->K[c][1],
-                                        x + K->K[c][0],
-                                        0 + K->K[c][3],
-                                        0 + K->K[c][4], value * K->K[c][5]);
-                  }
-               }
+   for(z = 0; z < sizes[0]; z++){
+      if(z < lo[0] || z >= hi[0]){
+         row = RAW_INDEX(src, z, 0, 0);
+         memcpy(&dst->data[row], &src->data[row], src->strides[0] * sizeof(float));
+         continue;
+         }
+      for(y = 0; y < sizes[1]; y++){
+         row = RAW_INDEX(src, z, y, 0);
+         if(y < lo[1] || y >= hi[1]){
+            memcpy(&dst->data[row], &src->data[row], sizes[2] * sizeof(float));
+            continue;
             }
+         memcpy(&dst->data[row], &src->data[row], lo[2] * sizeof(float));
+         memcpy(&dst->data[row + hi[2]], &src->data[row + hi[2]],
+                (sizes[2] - hi[2]) * sizeof(float));
          }
-
-      update_progress_report(&progress, z + 1);
       }
-
-   delete_volume(tmp_vol);
-   terminate_progress_report(&progress);
-   return (vol);
    }
 
-/* perform a median kernel operation on a volume */
-Volume  *median_dilation_kernel(Kernel * K, Volume * vol)
+/* structure for the arguments passed to the slab workers */
+typedef struct {
+   Kernel  *K;
+   Raw_volume *src;
+   Raw_volume *dst;
+   Raw_volume *cmp;
+   int     *order;
+   int     *pairs;                     /* median sorting network */
+   int      n_pairs;
+   int      is_max;
+   int      lo[3];                     /* valid source range (z, y, x) */
+   int      hi[3];
+   progress_struct *progress;
+   } slab_args_struct;
+
+/* order the kernel elements by descending offset, a gather over */
+/* this order sees its neighbours in the same sequence as the    */
+/* original scatter (raster order of the source voxel) did       */
+static int *scatter_order(Kernel * K)
 {
-   int      x, y, z, c, i;
-   int      sizes[MAX_VAR_DIMS];
-   progress_struct progress;
-   Volume   tmp_vol;
-   double   value;
-
-   unsigned int kvalue;
-   unsigned int neighbours[K->nelems];
+   int      c, i, tmp;
+   int     *order;
 
-   if(verbose){
-      fprintf(stdout, "Median Dilation kernel\n");
+   ALLOC(order, K->nelems + 1);
+   for(c = 0; c < K->nelems; c++){
+      order[c] = c;
       }
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Median Dilation");
 
-   /* copy the volume */
-   tmp_vol = copy_volume(*vol);
-
-   for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
-      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
-         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
+   /* insertion sort to keep equal offsets in element order */
+   for(c = 1; c < K->nelems; c++){
+      tmp = order[c];
+      for(i = c; i > 0 && K->offsets[order[i - 1]] < K->offsets[tmp]; i--){
+         order[i] = order[i - 1];
+         }
+      order[i] = tmp;
+      }
 
-            /* only modify background voxels */
-            value = get_volume_voxel_value(tmp_vol, z, y, x, 0, 0);
-            if(value == 0.0){
+   return order;
+   }
 
-               i = 0;
-               for(c = 0; c < K->nelems; c++){
+/* grey level erosion or dilation of the slice z into dst, slice sz of  */
+/* the source is at zsrc[sz] so the source need not be one volume.     */
+/* each output voxel q gathers from the source voxels p = q - offset    */
+/* that lie inside [lo, hi), for the kernel padding this is what the    */
+/* scatter from p to p + offset used to write                           */
+static void morph_slice(Kernel * K, int *order, float **zsrc, float *dst, int z,
+                        int sizes[], int lo[], int hi[], int is_max)
+{
+   int      x, y, c, i;
+   int      x_start, x_stop;
+   float   *out, *nbr;
+   double   coeff;
 
-                  kvalue = (unsigned int)get_volume_voxel_value(tmp_vol,
-                                                                z + K->K[c][2],
-                                                                y + K->K[c][1],
-                                                                x + K->K[c][0],
-                                                                0 + K->K[c][3],
-                                                                0 + K->K[c][4]);
-                  if(kvalue != 0){
-                     neighbours[i] = kvalue;
-                     i++;
-                     }
-                  }
+   for(y = 0; y < sizes[1]; y++){
+      out = &dst[(long)y * sizes[2]];
+      memcpy(out, &zsrc[z][(long)y * sizes[2]], sizes[2] * sizeof(float));
 
-               /* only run this for adjacent voxels */
-               if(i > 0){
+      for(i = 0; i < K->nelems; i++){
+         c = order[i];
 
-                  /* find the median of our little array */
-                  qsort(&neighbours[0], (size_t) i, sizeof(unsigned int), &compare_ints);
+         /* skip elements whose source voxel is outside the range */
+         if(z - K->dz[c] < lo[0] || z - K->dz[c] >= hi[0] ||
+            y - K->dy[c] < lo[1] || y - K->dy[c] >= hi[1]){
+            continue;
+            }
+         x_start = K->dx[c] + lo[2];
+         x_stop = hi[2] + K->dx[c];
+         if(x_start < 0){
+            x_start = 0;
+            }
+         if(x_stop > sizes[2]){
+            x_stop = sizes[2];
+            }
+         if(x_stop <= x_start){
+            continue;
+            }
 
-                  /* store the median value */
-                  set_volume_voxel_value(*vol, z, y, x, 0, 0,
-                                         (double)neighbours[(int)floor((i - 1) / 2)]);
+         nbr = &zsrc[z - K->dz[c]][(long)(y - K->dy[c]) * sizes[2]] - K->dx[c];
+         coeff = K->coeffs[c];
+         if(is_max){
+            if(K->unit_coeffs){
+               row_max(&out[x_start], &nbr[x_start], &out[x_start], x_stop - x_start);
+               }
+            else {
+               for(x = x_start; x < x_stop; x++){
+                  if(out[x] < nbr[x]){
+                     out[x] = nbr[x] * coeff;
+                     }
                   }
                }
-
-            /* else just copy the original value over */
+            }
+         else {
+            if(K->unit_coeffs){
+               row_min(&out[x_start], &nbr[x_start], &out[x_start], x_stop - x_start);
+               }
             else {
-               set_volume_voxel_value(*vol, z, y, x, 0, 0, value);
+               for(x = x_start; x < x_stop; x++){
+                  if(out[x] > nbr[x]){
+                     out[x] = nbr[x] * coeff;
+                     }
+                  }
                }
             }
          }
-
-      update_progress_report(&progress, z + 1);
       }
-
-   delete_volume(tmp_vol);
-   terminate_progress_report(&progress);
-   return (vol);
    }
 
-/* perform an erosion on a volume */
-Volume  *erosion_kernel(Kernel * K, Volume * vol)
+/* grey level erosion or dilation of the z-slab [start, stop) */
+static void morph_slab(void *arg, int start, int stop, int thread)
 {
-   int      x, y, z, c;
-   double   value;
-   int      sizes[MAX_VAR_DIMS];
-   progress_struct progress;
-   Volume   tmp_vol;
-
-   if(verbose){
-      fprintf(stdout, "Erosion kernel\n");
-   }
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Erosion");
-
-   /* copy the volume */
-   tmp_vol = copy_volume(*vol);
+   slab_args_struct *args = (slab_args_struct *) arg;
+   int      z;
+   float  **zsrc;
 
-   for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
-      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
-         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
+   ALLOC(zsrc, args->src->sizes[0]);
+   for(z = 0; z < args->src->sizes[0]; z++){
+      zsrc[z] = &args->src->data[RAW_INDEX(args->src, z, 0, 0)];
+      }
 
-            value = get_volume_real_value(tmp_vol, z, y, x, 0, 0);
-            for(c = 0; c < K->nelems; c++){
-               if(get_volume_real_value(*vol,
-                                        z + K->K[c][2],
-                                        y + K->K[c][1],
-                                        x + K->K[c][0],
-                                        0 + K->K[c][3], 0 + K->K[c][4]) > value){
-                  set_volume_real_value(*vol,
-                                        z + K->K[c][2],
-                                        y + K->K[c][1],
-                                        x + K->K[c][0],
-                                        0 + K->K[c][3],
-                                        0 + K->K[c][4], value * K->K[c][5]);
-                  }
-               }
+   for(z = start; z < stop; z++){
+      morph_slice(args->K, args->order, zsrc, &args->dst->data[RAW_INDEX(args->dst, z, 0, 0)],
+                  z, args->src->sizes, args->lo, args->hi, args->is_max);
 
-            value = get_volume_real_value(tmp_vol, z, y, x, 0, 0);
-            }
+      if(thread == 0 && args->progress != NULL){
+         update_progress_report(args->progress, z + 1);
          }
-      update_progress_report(&progress, z + 1);
       }
 
-   delete_volume(tmp_vol);
-   terminate_progress_report(&progress);
-   return (vol);
-}
+   FREE(zsrc);
+   }
 
-/* convolve a volume with a input kernel */
-Volume  *convolve_kernel(Kernel * K, Volume * vol)
+/* structure for the arguments of the kernel chain passes */
+typedef struct {
+   Raw_volume *src;
+   Raw_volume *dst;
+   int      lo[3];                     /* kernel padding (z, y, x) */
+   int      hi[3];
+   int      b0[3];                     /* box extent (z, y, x) */
+   int      b1[3];
+   int      is_max;
+   } box_args_struct;
+
+/* check if a kernel (plus the centre voxel) is a full box of unit */
+/* coefficients, if so return its extent in b0 and b1 (z, y, x)    */
+static int get_kernel_box(Kernel * K, int b0[], int b1[])
 {
-   int      x, y, z, c;
-   double   value;
-   int      sizes[MAX_VAR_DIMS];
-   progress_struct progress;
-   Volume   tmp_vol;
+   int      c, n, box_size, count;
+   long     idx;
+   char    *filled;
 
-   if(verbose){
-      fprintf(stdout, "Convolve kernel\n");
+   if(!K->unit_coeffs){
+      return FALSE;
       }
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Convolve");
-
-   /* copy the volume */
-   tmp_vol = copy_volume(*vol);
-
-   for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
-      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
-         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
 
-            value = 0;
-            for(c = 0; c < K->nelems; c++){
-               value += get_volume_real_value(tmp_vol,
-                                              z + K->K[c][2],
-                                              y + K->K[c][1],
-                                              x + K->K[c][0], 0 + K->K[c][3],
-                                              0 + K->K[c][4]) * K->K[c][5];
-               }
-            set_volume_real_value(*vol, z, y, x, 0, 0, value);
-            }
+   box_size = 1;
+   for(n = 0; n < 3; n++){
+      b0[n] = K->pre_pad[2 - n];
+      b1[n] = K->post_pad[2 - n];
+      box_size *= b1[n] - b0[n] + 1;
+      }
+   for(c = 0; c < K->nelems; c++){
+      if(K->K[c][3] != 0.0 || K->K[c][4] != 0.0){
+         return FALSE;
          }
+      }
+   if(K->nelems + 1 < box_size){
+      return FALSE;
+      }
 
-      update_progress_report(&progress, z + 1);
+   /* count the distinct elements, the centre is always included */
+   filled = (char *)calloc(box_size, sizeof(char));
+   filled[((-b0[0] * (b1[1] - b0[1] + 1)) - b0[1]) * (b1[2] - b0[2] + 1) - b0[2]] = 1;
+   count = 1;
+   for(c = 0; c < K->nelems; c++){
+      idx = ((long)(K->dz[c] - b0[0]) * (b1[1] - b0[1] + 1) + (K->dy[c] - b0[1]))
+         * (b1[2] - b0[2] + 1) + (K->dx[c] - b0[2]);
+      if(!filled[idx]){
+         filled[idx] = 1;
+         count++;
+         }
       }
+   free(filled);
 
-   delete_volume(tmp_vol);
-   terminate_progress_report(&progress);
-   return (vol);
+   return (count == box_size);
    }
 
-Volume  *median_filter_kernel(Kernel * K, Volume * vol)
+/* out = min (or max) of x and y over n lanes, short runs such as the  */
+/* single lane of an x pass are done inline rather than as a row call */
+static void lanes_extrema(float *out, float *x, float *y, int n, int is_max)
 {
-   int x, y, z, c;
-   int    sizes[MAX_VAR_DIMS];
-   Volume   tmp_vol;
-   progress_struct progress;
-   Real value;
-   Real neighbours[K->nelems];
+   int      l;
 
-   if(verbose){
-      fprintf(stdout, "Median filter kernel\n");
+   if(n >= 16){
+      if(is_max){
+         row_max(out, x, y, n);
+         }
+      else {
+         row_min(out, x, y, n);
+         }
+      }
+   else if(is_max){
+      for(l = 0; l < n; l++){
+         out[l] = (x[l] > y[l]) ? x[l] : y[l];
+         }
+      }
+   else {
+      for(l = 0; l < n; l++){
+         out[l] = (x[l] < y[l]) ? x[l] : y[l];
+         }
+      }
    }
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Median Filter");
 
-   /* copy the volume */
-   tmp_vol = copy_volume(*vol);
-
-   for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
-      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
-         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
+/* running min (or max) over the windows [q - b1, q - b0] of a set of  */
+/* lines using the van Herk/Gil-Werman algorithm, about 3 comparisons  */
+/* per voxel whatever the window length.  nlanes lines are interleaved */
+/* (element i of lane l is at data[i * stride + l]), only [lo, hi) of  */
+/* each line is read and every position [0, n) is written in place.    */
+/* buf must hold 2 * (hi - lo + 2 * (b1 - b0)) * nlanes floats         */
+static void vhgw_lines(float *data, long stride, int nlanes, int n, int lo, int hi,
+                       int b0, int b1, int is_max, float *buf)
+{
+   int      i, l, q, w, len, first, start;
+   float    ident;
+   float   *r, *s, *out, *a, *b;
 
-            for(c = 0; c < K->nelems; c++){
-               neighbours[c] = get_volume_voxel_value(tmp_vol,
-                                              z + K->K[c][2],
-                                              y + K->K[c][1],
-                                              x + K->K[c][0], 0 + K->K[c][3],
-                                              0 + K->K[c][4]);
+   w = b1 - b0 + 1;
+   if(hi < lo){
+      hi = lo;
+      }
+   len = (hi - lo) + 2 * (w - 1);
+   first = lo - (w - 1);
+   ident = (is_max) ? -FLT_MAX : FLT_MAX;
+   r = buf;
+   s = buf + (long)len * nlanes;
+
+   /* copy the line out, padded with the identity */
+   for(i = 0; i < len; i++){
+      a = &s[(long)i * nlanes];
+      if(first + i >= lo && first + i < hi){
+         b = &data[(first + i) * stride];
+         for(l = 0; l < nlanes; l++){
+            a[l] = b[l];
             }
-            /* find median of our little array */
-            qsort(neighbours, K->nelems, sizeof(Real), &compare_reals);
-            if ( K->nelems % 2 == 1 ){
-               value = neighbours[K->nelems / 2];
+         }
+      else {
+         for(l = 0; l < nlanes; l++){
+            a[l] = ident;
             }
-            else{
-               c = K->nelems / 2;
-               value = (neighbours[c] + neighbours[c-1]) / 2;
+         }
+      }
+
+   /* running extrema forwards (r) and backwards (s) within each block of w */
+   for(i = 0; i < len; i++){
+      a = &r[(long)i * nlanes];
+      b = &s[(long)i * nlanes];
+      if(i % w == 0){
+         for(l = 0; l < nlanes; l++){
+            a[l] = b[l];
             }
-            
-            /* store the median value */
-            set_volume_voxel_value(*vol, z, y, x, 0, 0, value);
          }
+      else {
+         lanes_extrema(a, a - nlanes, b, nlanes, is_max);
+         }
+      }
+   for(i = len - 2; i >= 0; i--){
+      if(i % w == w - 1){
+         continue;
+         }
+      a = &s[(long)i * nlanes];
+      lanes_extrema(a, a + nlanes, a, nlanes, is_max);
       }
 
-      update_progress_report(&progress, z + 1);
+   /* each window is the combination of a backward and a forward run */
+   for(q = 0; q < n; q++){
+      out = &data[q * stride];
+      start = q - b1 - first;
+      if(start < 0 || start > len - w){
+         for(l = 0; l < nlanes; l++){
+            out[l] = ident;
+            }
+         continue;
+         }
+      a = &s[(long)start * nlanes];
+      b = &r[(long)(start + w - 1) * nlanes];
+      lanes_extrema(out, a, b, nlanes, is_max);
+      }
    }
 
-   delete_volume(tmp_vol);
-   terminate_progress_report(&progress);
-   return (vol);
-}
+/* x pass of a box erosion/dilation over the z-slab [start, stop) */
+static void box_x_slab(void *arg, int start, int stop, int thread)
+{
+   box_args_struct *args = (box_args_struct *) arg;
+   int     *sizes = args->dst->sizes;
+   int      y, z;
+   float   *buf;
 
-/* should really only work on binary images    */
-/* from the original 2 pass Borgefors alg      */
-Volume  *distance_kernel(Kernel * K, Volume * vol, double bg)
+   buf = (float *)malloc(2 * (sizes[2] + 2 * (args->b1[2] - args->b0[2]) + 1) * sizeof(float));
+   for(z = start; z < stop; z++){
+      for(y = 0; y < sizes[1]; y++){
+         vhgw_lines(&args->dst->data[RAW_INDEX(args->dst, z, y, 0)], 1, 1, sizes[2],
+                    0, sizes[2], args->b0[2], args->b1[2], args->is_max, buf);
+         }
+      }
+   free(buf);
+   }
+
+/* y pass of a box erosion/dilation over the z-slab [start, stop) */
+static void box_y_slab(void *arg, int start, int stop, int thread)
 {
-   int      x, y, z, c;
-   double   value, min;
-   int      sizes[MAX_VAR_DIMS];
-   progress_struct progress;
-   Kernel  *k1, *k2;
+   box_args_struct *args = (box_args_struct *) arg;
+   int     *sizes = args->dst->sizes;
+   int      z;
+   float   *buf;
+
+   buf = (float *)malloc(2 * (sizes[1] + 2 * (args->b1[1] - args->b0[1]) + 1) *
+                         (long)sizes[2] * sizeof(float));
+   for(z = start; z < stop; z++){
+      vhgw_lines(&args->dst->data[RAW_INDEX(args->dst, z, 0, 0)], sizes[2], sizes[2],
+                 sizes[1], 0, sizes[1], args->b0[1], args->b1[1], args->is_max, buf);
+      }
+   free(buf);
+   }
 
-   /* split the Kernel */
-   k1 = new_kernel(K->nelems);
-   k2 = new_kernel(K->nelems);
-   split_kernel(K, k1, k2);
+/* z pass of a box erosion/dilation over the y-slab [start, stop) */
+static void box_z_slab(void *arg, int start, int stop, int thread)
+{
+   box_args_struct *args = (box_args_struct *) arg;
+   int     *sizes = args->dst->sizes;
+   int      y;
+   float   *buf;
+
+   buf = (float *)malloc(2 * (sizes[0] + 2 * (args->b1[0] - args->b0[0]) + 1) *
+                         (long)sizes[2] * sizeof(float));
+   for(y = start; y < stop; y++){
+      vhgw_lines(&args->dst->data[RAW_INDEX(args->dst, 0, y, 0)],
+                 args->dst->strides[0], sizes[2], sizes[0], 0, sizes[0],
+                 args->b0[0], args->b1[0], args->is_max, buf);
+      }
+   free(buf);
+   }
 
-   setup_pad_values(k1);
-   setup_pad_values(k2);
+/* copy the z-slab [start, stop) of src to dst, voxels outside the */
+/* kernel padding are set to the identity of the min (or max)      */
+static void mask_slab(void *arg, int start, int stop, int thread)
+{
+   box_args_struct *args = (box_args_struct *) arg;
+   int     *sizes = args->dst->sizes;
+   int      x, y, z;
+   long     row;
+   float    ident;
+   float   *src, *dst;
 
-   if(verbose){
-      fprintf(stdout, "Distance kernel - background %g\n", bg);
-      fprintf(stdout, "forward direction kernel:\n");
-      print_kernel(k1);
-      fprintf(stdout, "\nreverse direction kernel:\n");
-      print_kernel(k2);
+   ident = (args->is_max) ? -FLT_MAX : FLT_MAX;
+   for(z = start; z < stop; z++){
+      for(y = 0; y < sizes[1]; y++){
+         row = RAW_INDEX(args->dst, z, y, 0);
+         src = &args->src->data[row];
+         dst = &args->dst->data[row];
+         for(x = 0; x < sizes[2]; x++){
+            if(z < args->lo[0] || z >= args->hi[0] || y < args->lo[1] || y >= args->hi[1] ||
+               x < args->lo[2] || x >= args->hi[2]){
+               dst[x] = ident;
+               }
+            else {
+               dst[x] = src[x];
+               }
+            }
+         }
       }
+   }
 
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2] * 2, "Distance");
+/* combine the z-slab [start, stop) of the chain result in src with */
+/* the centre voxel in dst                                          */
+static void combine_slab(void *arg, int start, int stop, int thread)
+{
+   box_args_struct *args = (box_args_struct *) arg;
+   int     *sizes = args->dst->sizes;
+   int      y, z;
+   long     row;
+   float   *src, *dst;
 
-   /* forward raster direction */
+   for(z = start; z < stop; z++){
+      for(y = 0; y < sizes[1]; y++){
+         row = RAW_INDEX(args->dst, z, y, 0);
+         src = &args->src->data[row];
+         dst = &args->dst->data[row];
+         if(args->is_max){
+            row_max(dst, src, dst, sizes[2]);
+            }
+         else {
+            row_min(dst, src, dst, sizes[2]);
+            }
+         }
+      }
+   }
+
+/* erosion/dilation through the chain of factors of a decomposed   */
+/* kernel.  The source is masked to the kernel padding first, as   */
+/* every factor holds the centre each intermediate voxel stays in  */
+/* the volume and the result is identical to the per-element gather */
+static void chain_morph(Kernel * K, Raw_volume * src, Raw_volume * dst, int is_max)
+{
+   int      f, n;
+   Raw_volume *cur, *work;
+   Kernel  *factor;
+   box_args_struct args;
+   slab_args_struct sargs;
+
+   args.src = src;
+   args.dst = dst;
+   args.is_max = is_max;
+   for(n = 0; n < 3; n++){
+      args.lo[n] = -K->pre_pad[2 - n];
+      args.hi[n] = src->sizes[n] - K->post_pad[2 - n];
+      }
+   run_slabs(mask_slab, &args, 0, src->sizes[0]);
+
+   cur = dst;
+   work = NULL;
+   for(f = 0; f < K->n_factors; f++){
+      factor = K->factors[f];
+
+      /* boxes and lines as running min/max passes in place */
+      if(get_kernel_box(factor, args.b0, args.b1)){
+         args.dst = cur;
+         if(args.b1[2] > args.b0[2]){
+            run_slabs(box_x_slab, &args, 0, src->sizes[0]);
+            }
+         if(args.b1[1] > args.b0[1]){
+            run_slabs(box_y_slab, &args, 0, src->sizes[0]);
+            }
+         if(args.b1[0] > args.b0[0]){
+            run_slabs(box_z_slab, &args, 0, src->sizes[1]);
+            }
+         }
+
+      /* anything else as a gather into the other buffer */
+      else {
+         if(work == NULL){
+            work = new_raw_volume(src->sizes);
+            }
+         sargs.K = factor;
+         sargs.src = cur;
+         sargs.dst = (cur == dst) ? work : dst;
+         sargs.is_max = is_max;
+         sargs.progress = NULL;
+         for(n = 0; n < 3; n++){
+            sargs.lo[n] = 0;
+            sargs.hi[n] = src->sizes[n];
+            }
+         sargs.order = scatter_order(factor);
+         run_slabs(morph_slab, &sargs, 0, src->sizes[0]);
+         FREE(sargs.order);
+         cur = sargs.dst;
+         }
+      }
+
+   /* add the centre voxel */
+   if(cur != dst){
+      memcpy(dst->data, cur->data, dst->nvox * sizeof(float));
+      }
+   args.src = src;
+   args.dst = dst;
+   run_slabs(combine_slab, &args, 0, src->sizes[0]);
+
+   if(work != NULL){
+      delete_raw_volume(work);
+      }
+   }
+
+/* shared driver for erosion and dilation */
+static Raw_volume *morph_kernel(Kernel * K, Raw_volume * vol, int is_max)
+{
+   int      n;
+   slab_args_struct args;
+   progress_struct progress;
+
+   /* write into the spare volume, the source is left as it is */
+   args.K = K;
+   args.src = vol;
+   args.dst = get_spare_raw_volume(vol);
+   args.is_max = is_max;
+   args.progress = &progress;
+   for(n = 0; n < 3; n++){
+      args.lo[n] = -K->pre_pad[2 - n];
+      args.hi[n] = vol->sizes[n] - K->post_pad[2 - n];
+      }
+
+   /* decomposed kernels have a cost that grows with their extent */
+   if(K->n_factors > 0){
+      chain_morph(K, args.src, args.dst, is_max);
+      }
+   else {
+      initialize_progress_report(&progress, FALSE, vol->sizes[0],
+                                 (is_max) ? "Dilation" : "Erosion");
+      args.order = scatter_order(K);
+      run_slabs(morph_slab, &args, 0, vol->sizes[0]);
+      FREE(args.order);
+      terminate_progress_report(&progress);
+      }
+
+   release_raw_volume(vol);
+   return (args.dst);
+   }
+
+/* structure for the arguments of a fused erosion/dilation sequence */
+typedef struct {
+   Kernel  *K;
+   int     *order;
+   Raw_volume *src;
+   Raw_volume *dst;
+   int      n_stages;
+   int     *is_max;                    /* per stage */
+   int      lo[3];                     /* kernel padding (z, y, x) */
+   int      hi[3];
+   progress_struct *progress;
+   } fused_args_struct;
+
+/* state of one thread's pipeline, stage s reads the slices of stage */
+/* s - 1 through zptr[s - 1] and keeps its last depth slices in ring */
+typedef struct {
+   fused_args_struct *args;
+   int      depth;
+   float ***zptr;
+   float  **ring;
+   int     *next;
+   int     *last;
+   } pipeline_struct;
+
+/* compute slice z of stage s, pulling whatever the stage before still owes */
+static void pull_slice(pipeline_struct * pipe, int s, int z)
+{
+   fused_args_struct *args = pipe->args;
+   long     slice_size = args->src->strides[0];
+   int      need;
+   float   *dst;
+
+   if(s > 1){
+      need = z - args->K->pre_pad[2];
+      if(need > pipe->last[s - 1]){
+         need = pipe->last[s - 1];
+         }
+      while(pipe->next[s - 1] <= need){
+         pull_slice(pipe, s - 1, pipe->next[s - 1]);
+         }
+      }
+
+   if(s == args->n_stages){
+      dst = &args->dst->data[RAW_INDEX(args->dst, z, 0, 0)];
+      }
+   else {
+      dst = &pipe->ring[s][(z % pipe->depth) * slice_size];
+      }
+   morph_slice(args->K, args->order, pipe->zptr[s - 1], dst, z, args->src->sizes,
+               args->lo, args->hi, args->is_max[s - 1]);
+   pipe->zptr[s][z] = dst;
+   pipe->next[s] = z + 1;
+   }
+
+/* run the whole sequence for the output z-slab [start, stop), each */
+/* thread recomputes the earlier stages over the halo it needs      */
+static void fused_slab(void *arg, int start, int stop, int thread)
+{
+   fused_args_struct *args = (fused_args_struct *) arg;
+   int      nz = args->src->sizes[0];
+   int      s, z, first;
+   pipeline_struct pipe;
+
+   pipe.args = args;
+   pipe.depth = args->K->post_pad[2] - args->K->pre_pad[2] + 1;
+   ALLOC(pipe.zptr, args->n_stages + 1);
+   ALLOC(pipe.ring, args->n_stages + 1);
+   ALLOC(pipe.next, args->n_stages + 1);
+   ALLOC(pipe.last, args->n_stages + 1);
+
+   /* the slices each stage has to produce, working back from the output */
+   first = start;
+   pipe.last[args->n_stages] = stop - 1;
+   for(s = args->n_stages; s >= 1; s--){
+      pipe.next[s] = first;
+      if(s > 1){
+         first -= args->K->post_pad[2];
+         if(first < 0){
+            first = 0;
+            }
+         pipe.last[s - 1] = pipe.last[s] - args->K->pre_pad[2];
+         if(pipe.last[s - 1] > nz - 1){
+            pipe.last[s - 1] = nz - 1;
+            }
+         }
+      }
+
+   for(s = 0; s <= args->n_stages; s++){
+      ALLOC(pipe.zptr[s], nz);
+      pipe.ring[s] = NULL;
+      if(s > 0 && s < args->n_stages){
+         ALLOC(pipe.ring[s], pipe.depth * args->src->strides[0]);
+         }
+      }
+   for(z = 0; z < nz; z++){
+      pipe.zptr[0][z] = &args->src->data[RAW_INDEX(args->src, z, 0, 0)];
+      }
+
+   for(z = start; z < stop; z++){
+      pull_slice(&pipe, args->n_stages, z);
+
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
+
+   for(s = 0; s <= args->n_stages; s++){
+      FREE(pipe.zptr[s]);
+      if(pipe.ring[s] != NULL){
+         FREE(pipe.ring[s]);
+         }
+      }
+   FREE(pipe.zptr);
+   FREE(pipe.ring);
+   FREE(pipe.next);
+   FREE(pipe.last);
+   }
+
+/* run a sequence of erosions and dilations as one pipelined sweep    */
+/* over z where the intermediate stages only keep the few slices the   */
+/* next stage still needs, decomposed kernels are run a step at a time */
+static Raw_volume *fused_morph(Kernel * K, Raw_volume * vol, int is_max[], int n)
+{
+   int      c, n_vol;
+   Raw_volume *dst;
+   fused_args_struct args;
+   progress_struct progress;
+
+   if(n < 2 || K->n_factors > 0){
+      for(c = 0; c < n; c++){
+         vol = (is_max[c]) ? dilation_kernel(K, vol) : erosion_kernel(K, vol);
+         }
+      return (vol);
+      }
+
+   if(verbose){
+      fprintf(stdout, "Fused kernel sequence: ");
+      for(c = 0; c < n; c++){
+         fprintf(stdout, "%c", (is_max[c]) ? 'D' : 'E');
+         }
+      fprintf(stdout, "\n");
+      }
+
+   dst = get_spare_raw_volume(vol);
+   args.K = K;
+   args.order = scatter_order(K);
+   args.src = vol;
+   args.dst = dst;
+   args.n_stages = n;
+   args.is_max = is_max;
+   args.progress = &progress;
+   for(c = 0; c < 3; c++){
+      args.lo[c] = -K->pre_pad[2 - c];
+      args.hi[c] = vol->sizes[c] - K->post_pad[2 - c];
+      }
+
+   n_vol = vol->sizes[0];
+   initialize_progress_report(&progress, FALSE, n_vol, "Fused");
+   run_slabs(fused_slab, &args, 0, n_vol);
+   terminate_progress_report(&progress);
+
+   FREE(args.order);
+   release_raw_volume(vol);
+   return (dst);
+   }
+
+/* a sequence of erosions (is_max FALSE) and dilations with the same   */
+/* kernel, as done by O, C, L and runs of E and D.  A run of just one  */
+/* of them is followed on its active front, mixed ones are fused       */
+Raw_volume *morph_sequence_kernel(Kernel * K, Raw_volume * vol, int is_max[], int n)
+{
+   int      c;
+
+   c = 1;
+   while(c < n && is_max[c] == is_max[0]){
+      c++;
+      }
+   if(n >= 2 && c == n){
+      return front_kernel(K, vol, (is_max[0]) ? FRONT_DILATE : FRONT_ERODE, n);
+      }
+   return fused_morph(K, vol, is_max, n);
+   }
+
+/* perform a dilation on a volume */
+Raw_volume *dilation_kernel(Kernel * K, Raw_volume * vol)
+{
+   if(verbose){
+      fprintf(stdout, "Dilation kernel\n");
+      }
+   return morph_kernel(K, vol, TRUE);
+   }
+
+static void swap_floats(float *a, float *b)
+{
+   float    tmp = *a;
+
+   *a = *b;
+   *b = tmp;
+   }
+
+/* the k-th smallest of a[0..n), a is partially reordered so that */
+/* a[0..k) are no larger than it.  Quickselect down to a short     */
+/* insertion sort                                                 */
+static float select_nth(float *a, int n, int k)
+{
+   int      lo, hi, i, j;
+   float    pivot, tmp;
+
+   lo = 0;
+   hi = n - 1;
+   while(hi - lo > 8){
+
+      /* median of three pivot, moved to a[lo] */
+      i = lo + (hi - lo) / 2;
+      if(a[i] < a[lo]){
+         swap_floats(&a[i], &a[lo]);
+         }
+      if(a[hi] < a[lo]){
+         swap_floats(&a[hi], &a[lo]);
+         }
+      if(a[hi] < a[i]){
+         swap_floats(&a[hi], &a[i]);
+         }
+      swap_floats(&a[i], &a[lo]);
+      pivot = a[lo];
+
+      /* partition a[lo + 1..hi] around it */
+      i = lo;
+      j = hi + 1;
+      for(;;){
+         do {
+            i++;
+            } while(a[i] < pivot);
+         do {
+            j--;
+            } while(pivot < a[j]);
+         if(i >= j){
+            break;
+            }
+         swap_floats(&a[i], &a[j]);
+         }
+      a[lo] = a[j];
+      a[j] = pivot;
+
+      if(j == k){
+         return pivot;
+         }
+      if(j < k){
+         lo = j + 1;
+         }
+      else {
+         hi = j - 1;
+         }
+      }
+
+   for(i = lo + 1; i <= hi; i++){
+      tmp = a[i];
+      for(j = i; j > lo && tmp < a[j - 1]; j--){
+         a[j] = a[j - 1];
+         }
+      a[j] = tmp;
+      }
+   return a[k];
+   }
+
+/* median dilation of the z-slab [start, stop) */
+static void median_dilation_slab(void *arg, int start, int stop, int thread)
+{
+   slab_args_struct *args = (slab_args_struct *) arg;
+   Kernel  *K = args->K;
+   int     *sizes = args->src->sizes;
+   int      x, y, z, c, i;
+   long     idx, row;
+   double   value;
+
+   unsigned int kvalue;
+   float    neighbours[K->nelems];
+
+   for(z = start; z < stop; z++){
+      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
+         row = RAW_INDEX(args->src, z, y, 0);
+         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
+
+            /* only modify background voxels */
+            idx = row + x;
+            value = args->src->data[idx];
+            if(value == 0.0){
+
+               i = 0;
+               for(c = 0; c < K->nelems; c++){
+
+                  kvalue = (unsigned int)args->src->data[idx + K->offsets[c]];
+                  if(kvalue != 0){
+                     neighbours[i] = (float)kvalue;
+                     i++;
+                     }
+                  }
+
+               /* only run this for adjacent voxels */
+               if(i > 0){
+
+                  /* store the (lower) median value */
+                  args->dst->data[idx] = select_nth(neighbours, i, (i - 1) / 2);
+                  }
+               else {
+                  args->dst->data[idx] = value;
+                  }
+               }
+
+            /* else just copy the original value over */
+            else {
+               args->dst->data[idx] = value;
+               }
+            }
+         }
+
+      if(thread == 0 && args->progress != NULL){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
+   }
+
+/* perform a median kernel operation on a volume */
+Raw_volume *median_dilation_kernel(Kernel * K, Raw_volume * vol)
+{
+   slab_args_struct args;
+   progress_struct progress;
+
+   if(verbose){
+      fprintf(stdout, "Median Dilation kernel\n");
+      }
+   initialize_progress_report(&progress, FALSE, vol->sizes[0], "Median Dilation");
+
+   /* write into the spare volume, starting from the padding */
+   args.K = K;
+   args.src = vol;
+   args.dst = get_spare_raw_volume(vol);
+   args.progress = &progress;
+   copy_padding(K, args.src, args.dst);
+
+   run_slabs(median_dilation_slab, &args, -K->pre_pad[2], vol->sizes[0] - K->post_pad[2]);
+
+   release_raw_volume(vol);
+   terminate_progress_report(&progress);
+   return (args.dst);
+   }
+
+/* a growing list of voxel indices */
+typedef struct {
+   long    *idx;
+   long     n;
+   long     size;
+   } Voxel_list;
+
+static void add_voxel(Voxel_list * list, long idx)
+{
+   if(list->n == list->size){
+      list->size = (list->size < 1024) ? 1024 : 2 * list->size;
+      list->idx = (long *)realloc(list->idx, list->size * sizeof(long));
+      if(list->idx == NULL){
+         print_error("front_kernel(): could not allocate %ld voxels\n", list->size);
+         exit(EXIT_FAILURE);
+         }
+      }
+   list->idx[list->n++] = idx;
+   }
+
+/* structure for the arguments of the active front passes */
+typedef struct {
+   Kernel  *K;
+   int     *order;
+   front_types type;
+   Raw_volume *vol;
+   int      lo[3];                     /* kernel padding (z, y, x) */
+   int      hi[3];
+   long    *cand;                      /* voxels to redo */
+   float   *value;                     /* and their new values */
+   } front_args_struct;
+
+/* the new values of the candidates [start, stop), as the full passes */
+/* of the operation (morph_slice or median_dilation_slab) give them   */
+static void front_slab(void *arg, int start, int stop, int thread)
+{
+   front_args_struct *args = (front_args_struct *) arg;
+   Kernel  *K = args->K;
+   Raw_volume *vol = args->vol;
+   int      x, y, z, c, i, n;
+   long     idx;
+   float    out, nbr;
+   unsigned int kvalue;
+   float    neighbours[K->nelems];
+
+   for(i = start; i < stop; i++){
+      idx = args->cand[i];
+
+      /* the lower median of the labelled neighbours */
+      if(args->type == FRONT_MDILATE){
+         n = 0;
+         for(c = 0; c < K->nelems; c++){
+            kvalue = (unsigned int)vol->data[idx + K->offsets[c]];
+            if(kvalue != 0){
+               neighbours[n++] = (float)kvalue;
+               }
+            }
+         args->value[i] = (n > 0) ? select_nth(neighbours, n, (n - 1) / 2) : 0.0;
+         continue;
+         }
+
+      /* the min or max over the sources in range, in scatter order */
+      z = idx / vol->strides[0];
+      y = (idx % vol->strides[0]) / vol->strides[1];
+      x = idx % vol->strides[1];
+      out = vol->data[idx];
+      for(n = 0; n < K->nelems; n++){
+         c = args->order[n];
+         if(z - K->dz[c] < args->lo[0] || z - K->dz[c] >= args->hi[0] ||
+            y - K->dy[c] < args->lo[1] || y - K->dy[c] >= args->hi[1] ||
+            x - K->dx[c] < args->lo[2] || x - K->dx[c] >= args->hi[2]){
+            continue;
+            }
+         nbr = vol->data[idx - K->offsets[c]];
+         if(args->type == FRONT_DILATE){
+            if(K->unit_coeffs){
+               out = (nbr > out) ? nbr : out;
+               }
+            else if(out < nbr){
+               out = nbr * K->coeffs[c];
+               }
+            }
+         else {
+            if(K->unit_coeffs){
+               out = (nbr < out) ? nbr : out;
+               }
+            else if(out > nbr){
+               out = nbr * K->coeffs[c];
+               }
+            }
+         }
+      args->value[i] = out;
+      }
+   }
+
+/* add the voxels whose result depends on voxel idx to the candidates */
+static void add_front_voxels(front_args_struct * args, long idx, unsigned char *mark,
+                             Voxel_list * cand)
+{
+   Kernel  *K = args->K;
+   Raw_volume *vol = args->vol;
+   int      x, y, z, c, pos[3];
+   long     nidx;
+
+   z = idx / vol->strides[0];
+   y = (idx % vol->strides[0]) / vol->strides[1];
+   x = idx % vol->strides[1];
+
+   for(c = -1; c < K->nelems; c++){
+
+      /* morphology reads idx - offset, median dilation idx + offset */
+      if(c < 0){
+         pos[0] = z;
+         pos[1] = y;
+         pos[2] = x;
+         }
+      else if(args->type == FRONT_MDILATE){
+         pos[0] = z - K->dz[c];
+         pos[1] = y - K->dy[c];
+         pos[2] = x - K->dx[c];
+         }
+      else {
+         pos[0] = z + K->dz[c];
+         pos[1] = y + K->dy[c];
+         pos[2] = x + K->dx[c];
+         }
+
+      /* median dilation only fills in background voxels of the interior */
+      if(args->type == FRONT_MDILATE){
+         if(pos[0] < args->lo[0] || pos[0] >= args->hi[0] ||
+            pos[1] < args->lo[1] || pos[1] >= args->hi[1] ||
+            pos[2] < args->lo[2] || pos[2] >= args->hi[2]){
+            continue;
+            }
+         }
+      else if(pos[0] < 0 || pos[0] >= vol->sizes[0] ||
+              pos[1] < 0 || pos[1] >= vol->sizes[1] ||
+              pos[2] < 0 || pos[2] >= vol->sizes[2]){
+         continue;
+         }
+
+      nidx = RAW_INDEX(vol, pos[0], pos[1], pos[2]);
+      if(mark[nidx] || (args->type == FRONT_MDILATE && vol->data[nidx] != 0.0)){
+         continue;
+         }
+      mark[nidx] = TRUE;
+      add_voxel(cand, nidx);
+      }
+   }
+
+/* n steps of an erosion, dilation or median dilation.  Only voxels  */
+/* next to those that changed in the last step can change in the     */
+/* next, so after a first full pass each step only redoes the kernel */
+/* neighbourhood of the voxels that changed, making the cost follow  */
+/* the front rather than the volume.  Steps with a front too large   */
+/* for this (more than 1 / FRONT_DENSE of the volume to redo) are    */
+/* full passes, for erosion and dilation what is left of the run is  */
+/* then fused.  Stops early once nothing changes, with n < 0 that is */
+/* the only stop                                                     */
+Raw_volume *front_kernel(Kernel * K, Raw_volume * vol, front_types type, int n)
+{
+   int      c, step, dense;
+   long     i, idx, limit;
+   int     *is_max;
+   unsigned char *mark;
+   Voxel_list front, cand;
+   front_args_struct args;
+   slab_args_struct sargs;
+
+   if(verbose){
+      fprintf(stdout, "Active front %s - ", (type == FRONT_MDILATE) ? "median dilation" :
+              (type == FRONT_DILATE) ? "dilation" : "erosion");
+      if(n < 0){
+         fprintf(stdout, "until nothing changes\n");
+         }
+      else {
+         fprintf(stdout, "%d steps\n", n);
+         }
+      }
+
+   args.K = K;
+   args.order = scatter_order(K);
+   args.type = type;
+   for(c = 0; c < 3; c++){
+      args.lo[c] = -K->pre_pad[2 - c];
+      args.hi[c] = vol->sizes[c] - K->post_pad[2 - c];
+      }
+   mark = (unsigned char *)calloc(vol->nvox, sizeof(unsigned char));
+   if(mark == NULL){
+      print_error("front_kernel(): could not allocate %ld marks\n", vol->nvox);
+      exit(EXIT_FAILURE);
+      }
+   front.idx = cand.idx = NULL;
+   front.n = front.size = cand.n = cand.size = 0;
+   limit = vol->nvox / FRONT_DENSE / (K->nelems + 1);
+
+   dense = TRUE;
+   for(step = 0; n < 0 || step < n; step++){
+
+      /* a full pass, keeping what changed if it is few enough */
+      if(dense){
+         sargs.K = K;
+         sargs.order = args.order;
+         sargs.src = vol;
+         sargs.dst = get_spare_raw_volume(vol);
+         sargs.is_max = (type == FRONT_DILATE);
+         sargs.progress = NULL;
+         for(c = 0; c < 3; c++){
+            sargs.lo[c] = args.lo[c];
+            sargs.hi[c] = args.hi[c];
+            }
+         if(type == FRONT_MDILATE){
+            copy_padding(K, sargs.src, sargs.dst);
+            run_slabs(median_dilation_slab, &sargs, args.lo[0], args.hi[0]);
+            }
+         else {
+            run_slabs(morph_slab, &sargs, 0, vol->sizes[0]);
+            }
+
+         front.n = 0;
+         dense = FALSE;
+         for(idx = 0; idx < vol->nvox; idx++){
+            if(sargs.dst->data[idx] != vol->data[idx]){
+               if(front.n == limit){
+                  dense = TRUE;
+                  break;
+                  }
+               add_voxel(&front, idx);
+               }
+            }
+         release_raw_volume(vol);
+         vol = sargs.dst;
+
+         /* erosion and dilation fuse the rest of a dense run */
+         if(dense && type != FRONT_MDILATE && n >= 0 && step + 1 < n){
+            ALLOC(is_max, n - step - 1);
+            for(c = 0; c < n - step - 1; c++){
+               is_max[c] = (type == FRONT_DILATE);
+               }
+            vol = fused_morph(K, vol, is_max, n - step - 1);
+            FREE(is_max);
+            break;
+            }
+         }
+
+      /* redo the neighbourhood of the voxels that changed */
+      else {
+         args.vol = vol;
+         cand.n = 0;
+         for(i = 0; i < front.n; i++){
+            add_front_voxels(&args, front.idx[i], mark, &cand);
+            }
+
+         args.cand = cand.idx;
+         ALLOC(args.value, cand.n + 1);
+         run_slabs(front_slab, &args, 0, cand.n);
+
+         front.n = 0;
+         for(i = 0; i < cand.n; i++){
+            idx = cand.idx[i];
+            mark[idx] = FALSE;
+            if(args.value[i] != vol->data[idx]){
+               vol->data[idx] = args.value[i];
+               add_voxel(&front, idx);
+               }
+            }
+         FREE(args.value);
+         dense = (front.n > limit);
+         }
+
+      if(verbose){
+         if(dense){
+            fprintf(stdout, "  step %d: more than %ld voxels changed\n", step + 1, limit);
+            }
+         else {
+            fprintf(stdout, "  step %d: %ld voxels changed\n", step + 1, front.n);
+            }
+         }
+
+      /* nothing more will change */
+      if(!dense && front.n == 0){
+         break;
+         }
+      }
+
+   free(mark);
+   free(front.idx);
+   free(cand.idx);
+   FREE(args.order);
+   return (vol);
+   }
+
+/* perform an erosion on a volume */
+Raw_volume *erosion_kernel(Kernel * K, Raw_volume * vol)
+{
+   if(verbose){
+      fprintf(stdout, "Erosion kernel\n");
+   }
+   return morph_kernel(K, vol, FALSE);
+}
+
+/* structure for the arguments of the bit-packed passes */
+typedef struct {
+   Bit_volume *src;
+   Bit_volume *dst;
+   Bit_volume *cmp;
+   int      n;                         /* offsets, including the centre */
+   int     *dz, *dy, *dx;
+   int      lo[3];                     /* kernel padding (z, y, x) */
+   int      hi[3];
+   Bit_word *keep;                     /* words of a row inside the padding */
+   Bit_word *valid;                    /* words of a row inside the volume */
+   int      is_max;
+   } bit_args_struct;
+
+/* word w of a row shifted by dx voxels, reads outside the row give ident */
+static Bit_word shifted_word(Bit_word * row, long nw, long w, int dx, Bit_word ident)
+{
+   long     start, k;
+   int      rem;
+   Bit_word a, b;
+
+   start = w * BITS_PER_WORD - dx;
+   k = (start >= 0) ? start / BITS_PER_WORD : -((-start + BITS_PER_WORD - 1) / BITS_PER_WORD);
+   rem = (int)(start - k * BITS_PER_WORD);
+
+   a = (k >= 0 && k < nw) ? row[k] : ident;
+   if(rem == 0){
+      return a;
+      }
+   b = (k + 1 >= 0 && k + 1 < nw) ? row[k + 1] : ident;
+   return (a >> rem) | (b << (BITS_PER_WORD - rem));
+   }
+
+/* set the voxels of the z-slab [start, stop) outside the kernel */
+/* padding (and the row padding) to the identity, in place       */
+static void bit_mask_slab(void *arg, int start, int stop, int thread)
+{
+   bit_args_struct *args = (bit_args_struct *) arg;
+   Bit_volume *vol = args->dst;
+   int      y, z;
+   long     w;
+   Bit_word *row;
+
+   for(z = start; z < stop; z++){
+      for(y = 0; y < vol->sizes[1]; y++){
+         row = &vol->bits[BIT_ROW(vol, z, y)];
+         for(w = 0; w < vol->row_words; w++){
+            if(z < args->lo[0] || z >= args->hi[0] || y < args->lo[1] || y >= args->hi[1]){
+               row[w] = (args->is_max) ? 0 : ~(Bit_word) 0;
+               }
+            else if(args->is_max){
+               row[w] &= args->keep[w];
+               }
+            else {
+               row[w] |= ~args->keep[w];
+               }
+            }
+         }
+      }
+   }
+
+/* OR (dilation) or AND (erosion) the z-slab [start, stop) of src */
+/* over the offsets into dst, reads outside the volume are skipped */
+static void bit_gather_slab(void *arg, int start, int stop, int thread)
+{
+   bit_args_struct *args = (bit_args_struct *) arg;
+   Bit_volume *src = args->src;
+   int      y, z, c, sz, sy;
+   long     w, nw;
+   Bit_word ident;
+   Bit_word *row, *nbr;
+
+   nw = src->row_words;
+   ident = (args->is_max) ? 0 : ~(Bit_word) 0;
+   for(z = start; z < stop; z++){
+      for(y = 0; y < src->sizes[1]; y++){
+         row = &args->dst->bits[BIT_ROW(src, z, y)];
+         for(w = 0; w < nw; w++){
+            row[w] = ident;
+            }
+
+         for(c = 0; c < args->n; c++){
+            sz = z - args->dz[c];
+            sy = y - args->dy[c];
+            if(sz < 0 || sz >= src->sizes[0] || sy < 0 || sy >= src->sizes[1]){
+               continue;
+               }
+            nbr = &src->bits[BIT_ROW(src, sz, sy)];
+            if(args->dx[c] == 0){
+               if(args->is_max){
+                  for(w = 0; w < nw; w++){
+                     row[w] |= nbr[w];
+                     }
+                  }
+               else {
+                  for(w = 0; w < nw; w++){
+                     row[w] &= nbr[w];
+                     }
+                  }
+               }
+            else if(args->is_max){
+               for(w = 0; w < nw; w++){
+                  row[w] |= shifted_word(nbr, nw, w, args->dx[c], ident);
+                  }
+               }
+            else {
+               for(w = 0; w < nw; w++){
+                  row[w] &= shifted_word(nbr, nw, w, args->dx[c], ident);
+                  }
+               }
+            }
+
+         /* keep the row padding at the identity for the next pass */
+         for(w = 0; w < nw; w++){
+            row[w] = (args->is_max) ? (row[w] & args->valid[w]) : (row[w] | ~args->valid[w]);
+            }
+         }
+      }
+   }
+
+/* combine the z-slab [start, stop) of src with the centre voxels in cmp */
+static void bit_combine_slab(void *arg, int start, int stop, int thread)
+{
+   bit_args_struct *args = (bit_args_struct *) arg;
+   long     w, first, last;
+
+   first = BIT_ROW(args->dst, start, 0);
+   last = BIT_ROW(args->dst, stop, 0);
+   for(w = first; w < last; w++){
+      if(args->is_max){
+         args->dst->bits[w] = args->src->bits[w] | args->cmp->bits[w];
+         }
+      else {
+         args->dst->bits[w] = args->src->bits[w] & args->cmp->bits[w];
+         }
+      }
+   }
+
+/* run one bit-packed gather pass over a set of offsets, the centre */
+/* is always included.  Returns the buffer holding the result       */
+static Bit_volume *bit_pass(bit_args_struct * args, Bit_volume * cur, Bit_volume * work,
+                            int n, int *dz, int *dy, int *dx)
+{
+   int      c;
+
+   ALLOC(args->dz, n + 1);
+   ALLOC(args->dy, n + 1);
+   ALLOC(args->dx, n + 1);
+   args->dz[0] = args->dy[0] = args->dx[0] = 0;
+   for(c = 0; c < n; c++){
+      args->dz[c + 1] = dz[c];
+      args->dy[c + 1] = dy[c];
+      args->dx[c + 1] = dx[c];
+      }
+   args->n = n + 1;
+   args->src = cur;
+   args->dst = work;
+   run_slabs(bit_gather_slab, args, 0, cur->sizes[0]);
+   FREE(args->dz);
+   FREE(args->dy);
+   FREE(args->dx);
+
+   return work;
+   }
+
+/* erosion or dilation of a bit-packed binary volume, set bits are */
+/* the high value so these are an AND or OR over the kernel.  As   */
+/* with chain_morph the source is masked to the kernel padding so  */
+/* the result is identical to the float version                    */
+static Bit_volume *bit_morph_kernel(Kernel * K, Bit_volume * vol, int is_max,
+                                    long *n_changed)
+{
+   int      c, f, n, x, axis, b0[3], b1[3];
+   long     w;
+   int     *line[3];
+   Bit_volume *orig, *cur, *work, *tmp;
+   Kernel  *factor;
+   bit_args_struct args;
+
+   orig = copy_bit_volume(vol);
+   work = new_bit_volume(vol->sizes);
+   work->hi = vol->hi;
+   work->lo = vol->lo;
+
+   /* mask the source to the kernel padding */
+   args.is_max = is_max;
+   ALLOC(args.keep, vol->row_words);
+   ALLOC(args.valid, vol->row_words);
+   for(n = 0; n < 3; n++){
+      args.lo[n] = -K->pre_pad[2 - n];
+      args.hi[n] = vol->sizes[n] - K->post_pad[2 - n];
+      }
+   for(c = 0; c < vol->row_words; c++){
+      args.keep[c] = args.valid[c] = 0;
+      }
+   for(x = 0; x < vol->sizes[2]; x++){
+      args.valid[x / BITS_PER_WORD] |= (Bit_word) 1 << (x % BITS_PER_WORD);
+      if(x >= args.lo[2] && x < args.hi[2]){
+         args.keep[x / BITS_PER_WORD] |= (Bit_word) 1 << (x % BITS_PER_WORD);
+         }
+      }
+   args.dst = vol;
+   run_slabs(bit_mask_slab, &args, 0, vol->sizes[0]);
+
+   /* the gather over the kernel or each factor of its chain */
+   cur = vol;
+   if(K->n_factors == 0){
+      cur = bit_pass(&args, cur, work, K->nelems, K->dz, K->dy, K->dx);
+      work = vol;
+      }
+   for(f = 0; f < K->n_factors; f++){
+      factor = K->factors[f];
+
+      /* boxes as a line along each axis */
+      if(get_kernel_box(factor, b0, b1)){
+         for(axis = 0; axis < 3; axis++){
+            if(b1[axis] == b0[axis]){
+               continue;
+               }
+            for(n = 0; n < 3; n++){
+               ALLOC(line[n], b1[axis] - b0[axis] + 1);
+               }
+            n = 0;
+            for(c = b0[axis]; c <= b1[axis]; c++){
+               if(c != 0){
+                  line[0][n] = (axis == 0) ? c : 0;
+                  line[1][n] = (axis == 1) ? c : 0;
+                  line[2][n] = (axis == 2) ? c : 0;
+                  n++;
+                  }
+               }
+            tmp = bit_pass(&args, cur, work, n, line[0], line[1], line[2]);
+            work = cur;
+            cur = tmp;
+            for(n = 0; n < 3; n++){
+               FREE(line[n]);
+               }
+            }
+         }
+      else {
+         tmp = bit_pass(&args, cur, work, factor->nelems, factor->dz, factor->dy,
+                        factor->dx);
+         work = cur;
+         cur = tmp;
+         }
+      }
+
+   /* add the centre voxel, leaving the result in vol */
+   args.src = cur;
+   args.cmp = orig;
+   args.dst = vol;
+   run_slabs(bit_combine_slab, &args, 0, vol->sizes[0]);
+
+   /* count the voxels that changed */
+   if(n_changed != NULL){
+      *n_changed = 0;
+      for(w = 0; w < vol->nwords; w++){
+         *n_changed += __builtin_popcountll((orig->bits[w] ^ vol->bits[w]) &
+                                            args.valid[w % vol->row_words]);
+         }
+      }
+
+   FREE(args.keep);
+   FREE(args.valid);
+   delete_bit_volume(orig);
+   delete_bit_volume((work == vol) ? cur : work);
+   return (vol);
+   }
+
+/* perform an erosion on a bit-packed binary volume, the number */
+/* of voxels it changed goes in n_changed (if not NULL)          */
+Bit_volume *bit_erosion_kernel(Kernel * K, Bit_volume * vol, long *n_changed)
+{
+   if(verbose){
+      fprintf(stdout, "Erosion kernel (binary)\n");
+      }
+   return bit_morph_kernel(K, vol, FALSE, n_changed);
+   }
+
+/* perform a dilation on a bit-packed binary volume, the number */
+/* of voxels it changed goes in n_changed (if not NULL)         */
+Bit_volume *bit_dilation_kernel(Kernel * K, Bit_volume * vol, long *n_changed)
+{
+   if(verbose){
+      fprintf(stdout, "Dilation kernel (binary)\n");
+      }
+   return bit_morph_kernel(K, vol, TRUE, n_changed);
+   }
+
+/* convolve the z-slab [start, stop)                          */
+/* each row is accumulated one kernel element at a time so    */
+/* that the inner loop runs over contiguous voxels            */
+static void convolve_slab(void *arg, int start, int stop, int thread)
+{
+   slab_args_struct *args = (slab_args_struct *) arg;
+   Kernel  *K = args->K;
+   int     *sizes = args->src->sizes;
+   int      x, y, z, c;
+   int      x_start, x_stop;
+   long     row;
+   double   coeff;
+   double  *value;
+   float   *src;
+
+   x_start = -K->pre_pad[0];
+   x_stop = sizes[2] - K->post_pad[0];
+   ALLOC(value, sizes[2] + 1);
+
+   for(z = start; z < stop; z++){
+      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
+         row = RAW_INDEX(args->src, z, y, 0);
+
+         for(x = x_start; x < x_stop; x++){
+            value[x] = 0;
+            }
+         for(c = 0; c < K->nelems; c++){
+            src = &args->src->data[row + K->offsets[c]];
+            coeff = K->coeffs[c];
+            if(x_stop <= x_start){
+               continue;
+               }
+            if(K->unit_coeffs){
+               row_add(&value[x_start], &src[x_start], x_stop - x_start);
+               }
+            else {
+               row_madd(&value[x_start], &src[x_start], coeff, x_stop - x_start);
+               }
+            }
+         for(x = x_start; x < x_stop; x++){
+            args->dst->data[row + x] = value[x];
+            }
+         }
+
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
+
+   FREE(value);
+   }
+
+/* ways of doing a convolution */
+typedef enum {
+   CONV_DIRECT, CONV_SEPARABLE, CONV_FFT
+   } conv_types;
+
+/* structure for the arguments of the fast convolution passes */
+typedef struct {
+   Raw_volume *src;
+   Raw_volume *dst;
+   int      lo[3];                     /* range written (z, y, x) */
+   int      hi[3];
+   double  *f;                         /* separable: factor along axis */
+   int      n_f;
+   int      pre;                       /* offset of f[0] */
+   int      axis;                      /* 0 = z, 1 = y, 2 = x */
+   double  *tile;                      /* FFT: transform of the tile */
+   double  *spectrum;                  /* FFT: transform of the kernel */
+   int      tsize[3];                  /* FFT: tile size (z, y, x) */
+   Fft_plan *plan[3];
+   int      z0;                        /* FFT: first slice of the tile */
+   progress_struct *progress;
+   } conv_args_struct;
+
+/* the coefficients of a kernel on a dense grid over its padding,  */
+/* (z, y, x) with x varying fastest, repeated elements are summed  */
+static double *get_kernel_grid(Kernel * K, int ext[])
+{
+   int      c, n;
+   long     size;
+   double  *grid;
+
+   size = 1;
+   for(n = 0; n < 3; n++){
+      ext[n] = K->post_pad[2 - n] - K->pre_pad[2 - n] + 1;
+      size *= ext[n];
+      }
+   grid = (double *)calloc(size, sizeof(double));
+   for(c = 0; c < K->nelems; c++){
+      grid[((long)(K->dz[c] - K->pre_pad[2]) * ext[1] + (K->dy[c] - K->pre_pad[1]))
+           * ext[2] + (K->dx[c] - K->pre_pad[0])] += K->coeffs[c];
+      }
+   return grid;
+   }
+
+/* check if a kernel grid is the product of three 1D factors (z, y, */
+/* x), if so return them in f.  The factors are taken through the   */
+/* largest coefficient and have to give back every coefficient      */
+static int get_separable(double *grid, int ext[], double *f[])
+{
+   int      x, y, z, n, p[3];
+   long     i, size, pivot;
+   double   g;
+
+   size = (long)ext[0] * ext[1] * ext[2];
+   pivot = 0;
+   for(i = 1; i < size; i++){
+      if(fabs(grid[i]) > fabs(grid[pivot])){
+         pivot = i;
+         }
+      }
+   g = grid[pivot];
+   if(g == 0.0){
+      return FALSE;
+      }
+   p[2] = pivot % ext[2];
+   p[1] = (pivot / ext[2]) % ext[1];
+   p[0] = pivot / ((long)ext[1] * ext[2]);
+
+   for(n = 0; n < 3; n++){
+      ALLOC(f[n], ext[n]);
+      }
+   for(z = 0; z < ext[0]; z++){
+      f[0][z] = grid[((long)z * ext[1] + p[1]) * ext[2] + p[2]] / g;
+      }
+   for(y = 0; y < ext[1]; y++){
+      f[1][y] = grid[((long)p[0] * ext[1] + y) * ext[2] + p[2]] / g;
+      }
+   for(x = 0; x < ext[2]; x++){
+      f[2][x] = grid[((long)p[0] * ext[1] + p[1]) * ext[2] + x];
+      }
+
+   i = 0;
+   for(z = 0; z < ext[0]; z++){
+      for(y = 0; y < ext[1]; y++){
+         for(x = 0; x < ext[2]; x++){
+            if(fabs(grid[i] - f[0][z] * f[1][y] * f[2][x]) > 1e-6 * fabs(g)){
+               for(n = 0; n < 3; n++){
+                  FREE(f[n]);
+                  }
+               return FALSE;
+               }
+            i++;
+            }
+         }
+      }
+   return TRUE;
+   }
+
+/* pick the cheapest way of doing a convolution from the number of */
+/* multiply and adds each needs, for an FFT also the tile depth     */
+/* (tile_z is 0 for the others)                                     */
+static conv_types choose_convolve(Kernel * K, int sizes[], int ext[], int separable,
+                                  int *tile_z)
+{
+   int      n, nz, ny, nx, valid;
+   long     n_out, tile;
+   double   cost, best, tiles;
+   conv_types type;
+
+   *tile_z = 0;
+   n_out = 1;
+   for(n = 0; n < 3; n++){
+      if(sizes[n] - K->post_pad[2 - n] + K->pre_pad[2 - n] <= 0){
+         return CONV_DIRECT;
+         }
+      n_out *= sizes[n] - K->post_pad[2 - n] + K->pre_pad[2 - n];
+      }
+
+   /* direct, one multiply and add per element and output voxel */
+   type = CONV_DIRECT;
+   best = (double)K->nelems * n_out;
+
+   /* separable, one per element of each factor (and the rows the */
+   /* later passes need)                                          */
+   if(separable){
+      cost = (double)sizes[0] * sizes[1] * sizes[2] * (ext[0] + ext[1] + ext[2]);
+      if(cost < best){
+         type = CONV_SEPARABLE;
+         best = cost;
+         }
+      }
+
+   /* FFT, forward and inverse transforms of every tile */
+   ny = fft_size(sizes[1]);
+   nx = fft_size(sizes[2]);
+   for(nz = fft_size(ext[0]); (long)nz * ny * nx <= FFT_TILE_MAX; nz *= 2){
+      valid = nz - ext[0] + 1;
+      tile = (long)nz * ny * nx;
+      tiles = ceil((double)(sizes[0] - ext[0] + 1) / valid);
+      cost = tiles * tile * (2.0 * FFT_COST * log2((double)tile) + 1.0);
+      if(cost < best){
+         type = CONV_FFT;
+         best = cost;
+         *tile_z = nz;
+         }
+      if(valid >= sizes[0]){
+         break;
+         }
+      }
+
+   return type;
+   }
+
+/* one 1D pass of a separable convolution over the z-slab [start, */
+/* stop), the rows in lo and hi are written from the rows of src   */
+/* shifted along the axis                                          */
+static void separable_slab(void *arg, int start, int stop, int thread)
+{
+   conv_args_struct *args = (conv_args_struct *) arg;
+   int      y, z, i;
+   long     row, step;
+   double  *value;
+
+   step = args->src->strides[args->axis];
+   ALLOC(value, args->src->sizes[2] + 1);
+
+   for(z = start; z < stop; z++){
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         row = RAW_INDEX(args->src, z, y, args->lo[2]);
+         memset(value, 0, (args->hi[2] - args->lo[2]) * sizeof(double));
+         for(i = 0; i < args->n_f; i++){
+            if(args->f[i] != 0.0){
+               row_madd(value, &args->src->data[row + (args->pre + i) * step],
+                        args->f[i], args->hi[2] - args->lo[2]);
+               }
+            }
+         for(i = 0; i < args->hi[2] - args->lo[2]; i++){
+            args->dst->data[row + i] = value[i];
+            }
+         }
+
+      if(thread == 0 && args->progress != NULL){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
+
+   FREE(value);
+   }
+
+/* separable convolution as passes along x, y and then z.  Each pass */
+/* only writes the rows the next one reads, the padding is copied    */
+/* across at the end                                                 */
+static void separable_convolve(Kernel * K, Raw_volume * src, Raw_volume * dst,
+                               double *f[], int ext[], progress_struct * progress)
+{
+   int      n;
+   Raw_volume *tmp;
+   conv_args_struct args;
+
+   tmp = new_raw_volume(src->sizes);
+   args.progress = NULL;
+   for(n = 0; n < 3; n++){
+      args.lo[n] = 0;
+      args.hi[n] = src->sizes[n];
+      }
+
+   for(n = 2; n >= 0; n--){
+      args.src = (n == 2) ? src : (n == 1) ? dst : tmp;
+      args.dst = (n == 1) ? tmp : dst;
+      args.axis = n;
+      args.f = f[n];
+      args.n_f = ext[n];
+      args.pre = K->pre_pad[2 - n];
+      args.lo[n] = -K->pre_pad[2 - n];
+      args.hi[n] = src->sizes[n] - K->post_pad[2 - n];
+      if(n == 0){
+         args.progress = progress;
+         }
+      run_slabs(separable_slab, &args, args.lo[0], args.hi[0]);
+      }
+
+   delete_raw_volume(tmp);
+   copy_padding(K, src, dst);
+   }
+
+/* FFT of the rows of a tile then of its columns, over the planes */
+/* [start, stop).  With a source the planes are first filled from */
+/* its slices, zero beyond the edges of the volume                */
+static void fft_planes_slab(void *arg, int start, int stop, int thread)
+{
+   conv_args_struct *args = (conv_args_struct *) arg;
+   int     *tsize = args->tsize;
+   int      x, y, z, zs, n_rows;
+   long     plane;
+   double  *data, *line;
+
+   ALLOC(line, 2 * tsize[1]);
+   n_rows = (args->src != NULL) ? args->src->sizes[1] : tsize[1];
+
+   for(z = start; z < stop; z++){
+      plane = (long)z * tsize[1] * tsize[2];
+      data = &args->tile[2 * plane];
+
+      if(args->src != NULL){
+         memset(data, 0, 2 * (long)tsize[1] * tsize[2] * sizeof(double));
+         zs = args->z0 + z;
+         if(zs >= 0 && zs < args->src->sizes[0]){
+            for(y = 0; y < args->src->sizes[1]; y++){
+               for(x = 0; x < args->src->sizes[2]; x++){
+                  data[2 * ((long)y * tsize[2] + x)] =
+                     args->src->data[RAW_INDEX(args->src, zs, y, x)];
+                  }
+               }
+            }
+         }
+
+      /* rows past the end of the volume are still zero */
+      for(y = 0; y < n_rows; y++){
+         fft(args->plan[2], &data[2 * (long)y * tsize[2]], FALSE);
+         }
+      for(x = 0; x < tsize[2]; x++){
+         for(y = 0; y < tsize[1]; y++){
+            line[2 * y] = data[2 * ((long)y * tsize[2] + x)];
+            line[2 * y + 1] = data[2 * ((long)y * tsize[2] + x) + 1];
+            }
+         fft(args->plan[1], line, FALSE);
+         for(y = 0; y < tsize[1]; y++){
+            data[2 * ((long)y * tsize[2] + x)] = line[2 * y];
+            data[2 * ((long)y * tsize[2] + x) + 1] = line[2 * y + 1];
+            }
+         }
+      }
+
+   FREE(line);
+   }
+
+/* FFT along z of the columns [start, stop) of a tile in y.  With */
+/* a kernel spectrum the columns are multiplied by it and brought */
+/* back with the inverse transform                                */
+static void fft_columns_slab(void *arg, int start, int stop, int thread)
+{
+   conv_args_struct *args = (conv_args_struct *) arg;
+   int     *tsize = args->tsize;
+   int      x, y, z;
+   long     idx, plane;
+   double   re, im, tmp;
+   double  *line;
+
+   ALLOC(line, 2 * tsize[0]);
+   plane = (long)tsize[1] * tsize[2];
+
+   for(y = start; y < stop; y++){
+      for(x = 0; x < tsize[2]; x++){
+         idx = (long)y * tsize[2] + x;
+         for(z = 0; z < tsize[0]; z++){
+            line[2 * z] = args->tile[2 * (z * plane + idx)];
+            line[2 * z + 1] = args->tile[2 * (z * plane + idx) + 1];
+            }
+         fft(args->plan[0], line, FALSE);
+         if(args->spectrum != NULL){
+            for(z = 0; z < tsize[0]; z++){
+               re = args->spectrum[2 * (z * plane + idx)];
+               im = args->spectrum[2 * (z * plane + idx) + 1];
+               tmp = line[2 * z] * re - line[2 * z + 1] * im;
+               line[2 * z + 1] = line[2 * z] * im + line[2 * z + 1] * re;
+               line[2 * z] = tmp;
+               }
+            fft(args->plan[0], line, TRUE);
+            }
+         for(z = 0; z < tsize[0]; z++){
+            args->tile[2 * (z * plane + idx)] = line[2 * z];
+            args->tile[2 * (z * plane + idx) + 1] = line[2 * z + 1];
+            }
+         }
+      }
+
+   FREE(line);
+   }
+
+/* inverse FFT of the columns then the rows of the planes [start, */
+/* stop) of a tile, writing the rows in lo and hi to dst           */
+static void fft_output_slab(void *arg, int start, int stop, int thread)
+{
+   conv_args_struct *args = (conv_args_struct *) arg;
+   int     *tsize = args->tsize;
+   int      x, y, z, zs;
+   long     row;
+   double   scale;
+   double  *data, *line;
+
+   ALLOC(line, 2 * tsize[1]);
+   scale = 1.0 / ((double)tsize[0] * tsize[1] * tsize[2]);
+
+   for(z = start; z < stop; z++){
+      data = &args->tile[2 * (long)z * tsize[1] * tsize[2]];
+      zs = args->z0 + z;
+
+      for(x = 0; x < tsize[2]; x++){
+         for(y = 0; y < tsize[1]; y++){
+            line[2 * y] = data[2 * ((long)y * tsize[2] + x)];
+            line[2 * y + 1] = data[2 * ((long)y * tsize[2] + x) + 1];
+            }
+         fft(args->plan[1], line, TRUE);
+         for(y = args->lo[1]; y < args->hi[1]; y++){
+            data[2 * ((long)y * tsize[2] + x)] = line[2 * y];
+            data[2 * ((long)y * tsize[2] + x) + 1] = line[2 * y + 1];
+            }
+         }
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         fft(args->plan[2], &data[2 * (long)y * tsize[2]], TRUE);
+         row = RAW_INDEX(args->dst, zs, y, 0);
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+            args->dst->data[row + x] = data[2 * ((long)y * tsize[2] + x)] * scale;
+            }
+         }
+
+      if(thread == 0){
+         update_progress_report(args->progress, zs + 1);
+         }
+      }
+
+   FREE(line);
+   }
+
+/* convolution as the product of FFTs, overlap-save over tiles of    */
+/* tile_z slices.  The tiles are at least as wide as the volume in x  */
+/* and y so nothing wraps around there, in z each tile gives the      */
+/* slices it holds the whole kernel window of                        */
+static void fft_convolve(Kernel * K, Raw_volume * src, Raw_volume * dst, int tile_z,
+                         progress_struct * progress)
+{
+   int      c, n, z, valid;
+   long     size;
+   conv_args_struct args;
+
+   args.tsize[0] = tile_z;
+   args.tsize[1] = fft_size(src->sizes[1]);
+   args.tsize[2] = fft_size(src->sizes[2]);
+   size = (long)args.tsize[0] * args.tsize[1] * args.tsize[2];
+   for(n = 0; n < 3; n++){
+      args.plan[n] = new_fft_plan(args.tsize[n]);
+      args.lo[n] = -K->pre_pad[2 - n];
+      args.hi[n] = src->sizes[n] - K->post_pad[2 - n];
+      }
+   args.dst = dst;
+   args.progress = progress;
+   ALLOC(args.tile, 2 * size);
+   ALLOC(args.spectrum, 2 * size);
+
+   /* the kernel is mirrored as the convolution reads at +offset */
+   memset(args.spectrum, 0, 2 * size * sizeof(double));
+   for(c = 0; c < K->nelems; c++){
+      args.spectrum[2 * (((long)((tile_z - K->dz[c]) % tile_z) * args.tsize[1] +
+                          (args.tsize[1] - K->dy[c]) % args.tsize[1]) * args.tsize[2] +
+                         (args.tsize[2] - K->dx[c]) % args.tsize[2])] += K->coeffs[c];
+      }
+   args.src = NULL;
+   args.tile = args.spectrum;
+   args.spectrum = NULL;
+   run_slabs(fft_planes_slab, &args, 0, args.tsize[0]);
+   run_slabs(fft_columns_slab, &args, 0, args.tsize[1]);
+   args.spectrum = args.tile;
+   ALLOC(args.tile, 2 * size);
+
+   /* each tile gives valid slices from the first full window on */
+   args.src = src;
+   valid = tile_z - (K->post_pad[2] - K->pre_pad[2]);
+   for(z = args.lo[0]; z < args.hi[0]; z += valid){
+      args.z0 = z + K->pre_pad[2];
+      run_slabs(fft_planes_slab, &args, 0, args.tsize[0]);
+      run_slabs(fft_columns_slab, &args, 0, args.tsize[1]);
+      n = (z + valid < args.hi[0]) ? valid : args.hi[0] - z;
+      run_slabs(fft_output_slab, &args, -K->pre_pad[2], -K->pre_pad[2] + n);
+      }
+
+   FREE(args.tile);
+   FREE(args.spectrum);
+   for(n = 0; n < 3; n++){
+      delete_fft_plan(args.plan[n]);
+      }
+   copy_padding(K, src, dst);
+   }
+
+/* convolve a volume with a input kernel, separable kernels as three */
+/* 1D passes and large ones through FFTs when that is cheaper        */
+Raw_volume *convolve_kernel(Kernel * K, Raw_volume * vol)
+{
+   int      n, ext[3], tile_z, separable;
+   double  *grid, *f[3];
+   conv_types type;
+   slab_args_struct args;
+   progress_struct progress;
+
+   /* pick a way of doing it */
+   grid = get_kernel_grid(K, ext);
+   separable = get_separable(grid, ext, f);
+   free(grid);
+   type = choose_convolve(K, vol->sizes, ext, separable, &tile_z);
+
+   if(verbose){
+      fprintf(stdout, "Convolve kernel%s\n", (type == CONV_SEPARABLE) ? " (separable)" :
+              (type == CONV_FFT) ? " (FFT)" : "");
+      }
+   initialize_progress_report(&progress, FALSE, vol->sizes[0], "Convolve");
+
+   /* write into the spare volume, starting from the padding */
+   args.K = K;
+   args.src = vol;
+   args.dst = get_spare_raw_volume(vol);
+   args.progress = &progress;
+
+   switch (type){
+   case CONV_SEPARABLE:
+      separable_convolve(K, args.src, args.dst, f, ext, &progress);
+      break;
+
+   case CONV_FFT:
+      fft_convolve(K, args.src, args.dst, tile_z, &progress);
+      break;
+
+   default:
+      copy_padding(K, args.src, args.dst);
+      run_slabs(convolve_slab, &args, -K->pre_pad[2], vol->sizes[0] - K->post_pad[2]);
+      break;
+      }
+
+   if(separable){
+      for(n = 0; n < 3; n++){
+         FREE(f[n]);
+         }
+      }
+   release_raw_volume(vol);
+   terminate_progress_report(&progress);
+   return (args.dst);
+   }
+
+/* the compare-exchanges of a sorting network for n values that    */
+/* the median (the middle one or two) depends on.  This is Batcher's */
+/* odd-even merge sort with the exchanges that only lead to other    */
+/* outputs pruned, returns the number of pairs set in pairs          */
+static int median_network(int n, int **pairs)
+{
+   int      p, k, j, i, c, n_pairs;
+   int     *all;
+   char    *needed;
+
+   /* the full network */
+   n_pairs = 0;
+   ALLOC(all, 2 * n * n + 2);
+   for(p = 1; p < n; p += p){
+      for(k = p; k > 0; k /= 2){
+         for(j = k % p; j + k < n; j += k + k){
+            for(i = 0; i < k && i + j + k < n; i++){
+               if((i + j) / (p + p) == (i + j + k) / (p + p)){
+                  all[2 * n_pairs] = i + j;
+                  all[2 * n_pairs + 1] = i + j + k;
+                  n_pairs++;
+                  }
+               }
+            }
+         }
+      }
+
+   /* walk back from the median keeping what it depends on */
+   ALLOC(needed, n);
+   for(i = 0; i < n; i++){
+      needed[i] = (i == n / 2 || (n % 2 == 0 && i == n / 2 - 1));
+      }
+   ALLOC(*pairs, 2 * n_pairs + 2);
+   j = n_pairs;
+   for(c = n_pairs; c--;){
+      if(needed[all[2 * c]] || needed[all[2 * c + 1]]){
+         needed[all[2 * c]] = needed[all[2 * c + 1]] = TRUE;
+         j--;
+         (*pairs)[2 * j] = all[2 * c];
+         (*pairs)[2 * j + 1] = all[2 * c + 1];
+         }
+      }
+
+   /* shift the kept pairs down to the start */
+   for(c = j; c < n_pairs; c++){
+      (*pairs)[2 * (c - j)] = (*pairs)[2 * c];
+      (*pairs)[2 * (c - j) + 1] = (*pairs)[2 * c + 1];
+      }
+
+   FREE(all);
+   FREE(needed);
+   return n_pairs - j;
+   }
+
+/* median filter the z-slab [start, stop).  With a sorting network */
+/* each row of voxels is done MEDIAN_BLOCK at a time: the rows of   */
+/* neighbours are copied out and compare-exchanged as whole rows    */
+/* with the (vector) row kernels until the middle ones hold the     */
+/* medians.  Larger kernels select the median voxel by voxel        */
+static void median_filter_slab(void *arg, int start, int stop, int thread)
+{
+   slab_args_struct *args = (slab_args_struct *) arg;
+   Kernel  *K = args->K;
+   int     *sizes = args->src->sizes;
+   int      n = K->nelems;
+   int      x, y, z, c, x0, x1, len;
+   long     row;
+   Real     value;
+   float   *rows;
+   float    neighbours[n];
+
+   x0 = -K->pre_pad[0];
+   x1 = sizes[2] - K->post_pad[0];
+   rows = NULL;
+   if(args->pairs != NULL){
+      ALLOC(rows, n * MEDIAN_BLOCK);
+      }
+
+   for(z = start; z < stop; z++){
+      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
+         row = RAW_INDEX(args->src, z, y, 0);
+
+         if(args->pairs != NULL){
+            for(x = x0; x < x1; x += MEDIAN_BLOCK){
+               len = (x1 - x < MEDIAN_BLOCK) ? x1 - x : MEDIAN_BLOCK;
+               for(c = 0; c < n; c++){
+                  memcpy(&rows[c * MEDIAN_BLOCK], &args->src->data[row + x + K->offsets[c]],
+                         len * sizeof(float));
+                  }
+               for(c = 0; c < args->n_pairs; c++){
+                  row_minmax(&rows[args->pairs[2 * c] * MEDIAN_BLOCK],
+                             &rows[args->pairs[2 * c + 1] * MEDIAN_BLOCK], len);
+                  }
+
+               /* store the median values */
+               for(c = 0; c < len; c++){
+                  if(n % 2 == 1){
+                     value = rows[(n / 2) * MEDIAN_BLOCK + c];
+                     }
+                  else {
+                     value = ((Real) rows[(n / 2 - 1) * MEDIAN_BLOCK + c] +
+                              rows[(n / 2) * MEDIAN_BLOCK + c]) / 2;
+                     }
+                  args->dst->data[row + x + c] = value;
+                  }
+               }
+            continue;
+            }
+
+         for(x = x0; x < x1; x++){
+            for(c = 0; c < n; c++){
+               neighbours[c] = args->src->data[row + x + K->offsets[c]];
+               }
+
+            /* find the median of our little array, the lower */
+            /* middle value is the largest of those before it */
+            value = select_nth(neighbours, n, n / 2);
+            if(n % 2 == 0){
+               value = (value + select_nth(neighbours, n / 2, n / 2 - 1)) / 2;
+               }
+
+            /* store the median value */
+            args->dst->data[row + x] = value;
+            }
+         }
+
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
+
+   if(rows != NULL){
+      FREE(rows);
+      }
+   }
+
+Raw_volume *median_filter_kernel(Kernel * K, Raw_volume * vol)
+{
+   slab_args_struct args;
+   progress_struct progress;
+
+   if(verbose){
+      fprintf(stdout, "Median filter kernel\n");
+      }
+   initialize_progress_report(&progress, FALSE, vol->sizes[0], "Median Filter");
+
+   /* write into the spare volume, starting from the padding */
+   args.K = K;
+   args.src = vol;
+   args.dst = get_spare_raw_volume(vol);
+   args.progress = &progress;
+   copy_padding(K, args.src, args.dst);
+
+   /* small kernels are sorted with a network over rows of voxels */
+   args.pairs = NULL;
+   if(K->nelems > 1 && K->nelems <= MEDIAN_NETWORK_MAX){
+      args.n_pairs = median_network(K->nelems, &args.pairs);
+      }
+
+   run_slabs(median_filter_slab, &args, -K->pre_pad[2], vol->sizes[0] - K->post_pad[2]);
+
+   if(args.pairs != NULL){
+      FREE(args.pairs);
+      }
+   release_raw_volume(vol);
+   terminate_progress_report(&progress);
+   return (args.dst);
+   }
+
+/* structure for the arguments of the rank filter */
+typedef struct {
+   Kernel  *K;
+   Raw_volume *src;
+   Raw_volume *dst;
+   int      rank;
+   int      use_hist;
+   double   vmin;                      /* value of histogram bin 0 */
+   int      n_bins;
+   int      n_steps;                   /* changes to the window per step in x */
+   long    *step_offsets;
+   int     *step_weights;
+   progress_struct *progress;
+   } rank_args_struct;
+
+/* the changes to a kernel's window as it moves one voxel along x, */
+/* as offsets from the new centre with a weight of +1 for voxels   */
+/* coming in and -1 for those going out.  Returns how many         */
+static int window_steps(Kernel * K, long **offsets, int **weights)
+{
+   int      c, i, n;
+   long     off;
+
+   ALLOC(*offsets, 2 * K->nelems + 1);
+   ALLOC(*weights, 2 * K->nelems + 1);
+
+   n = 0;
+   for(c = 0; c < 2 * K->nelems; c++){
+      off = (c < K->nelems) ? K->offsets[c] : K->offsets[c - K->nelems] - 1;
+      i = 0;
+      while(i < n && (*offsets)[i] != off){
+         i++;
+         }
+      if(i == n){
+         (*offsets)[n] = off;
+         (*weights)[n] = 0;
+         n++;
+         }
+      (*weights)[i] += (c < K->nelems) ? 1 : -1;
+      }
+
+   /* drop the voxels that stay in the window */
+   for(c = i = 0; c < n; c++){
+      if((*weights)[c] != 0){
+         (*offsets)[i] = (*offsets)[c];
+         (*weights)[i] = (*weights)[c];
+         i++;
+         }
+      }
+   return i;
+   }
+
+/* rank filter the z-slab [start, stop).  For integer data a histogram */
+/* of the window is kept as it slides along each row, only the voxels  */
+/* coming in and going out of it are touched and the rank is found     */
+/* with a coarse histogram of HIST_COARSE bins a block, so the cost of */
+/* a voxel does not depend on the size of the kernel                   */
+static void rank_filter_slab(void *arg, int start, int stop, int thread)
+{
+   rank_args_struct *args = (rank_args_struct *) arg;
+   Kernel  *K = args->K;
+   float   *data = args->src->data;
+   int     *sizes = args->src->sizes;
+   int      n = K->nelems;
+   int      x, y, z, c, x0, x1, bin, count;
+   long     idx, row;
+   unsigned int *hist, *coarse;
+   float    neighbours[n];
+
+   x0 = -K->pre_pad[0];
+   x1 = sizes[2] - K->post_pad[0];
+   hist = coarse = NULL;
+   if(args->use_hist){
+      hist = (unsigned int *)calloc(args->n_bins, sizeof(unsigned int));
+      coarse = (unsigned int *)calloc(args->n_bins / HIST_COARSE + 1, sizeof(unsigned int));
+      if(hist == NULL || coarse == NULL){
+         print_error("rank_filter_kernel(): could not allocate %d bins\n", args->n_bins);
+         exit(EXIT_FAILURE);
+         }
+      }
+
+   for(z = start; z < stop; z++){
+      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
+         row = RAW_INDEX(args->src, z, y, 0);
+
+         if(!args->use_hist){
+            for(x = x0; x < x1; x++){
+               for(c = 0; c < n; c++){
+                  neighbours[c] = data[row + x + K->offsets[c]];
+                  }
+               args->dst->data[row + x] = select_nth(neighbours, n, args->rank);
+               }
+            continue;
+            }
+
+         for(x = x0; x < x1; x++){
+            idx = row + x;
+
+            /* fill the window at the start of a row, then slide it */
+            if(x == x0){
+               for(c = 0; c < n; c++){
+                  bin = (int)(data[idx + K->offsets[c]] - args->vmin);
+                  hist[bin]++;
+                  coarse[bin / HIST_COARSE]++;
+                  }
+               }
+            else {
+               for(c = 0; c < args->n_steps; c++){
+                  bin = (int)(data[idx + args->step_offsets[c]] - args->vmin);
+                  hist[bin] += args->step_weights[c];
+                  coarse[bin / HIST_COARSE] += args->step_weights[c];
+                  }
+               }
+
+            /* find the bin holding the rank */
+            count = 0;
+            for(bin = 0; count + coarse[bin] <= args->rank; bin++){
+               count += coarse[bin];
+               }
+            for(bin *= HIST_COARSE; count + hist[bin] <= args->rank; bin++){
+               count += hist[bin];
+               }
+            args->dst->data[idx] = args->vmin + bin;
+            }
+
+         /* empty the histogram again */
+         if(x1 > x0){
+            for(c = 0; c < n; c++){
+               bin = (int)(data[row + x1 - 1 + K->offsets[c]] - args->vmin);
+               hist[bin]--;
+               coarse[bin / HIST_COARSE]--;
+               }
+            }
+         }
+
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
+
+   if(hist != NULL){
+      free(hist);
+      free(coarse);
+      }
+   }
+
+/* set each voxel to the p-th percentile (0 to 100) of its kernel  */
+/* neighbours, the value of rank (n - 1) * p / 100 (rounded) once  */
+/* sorted.  0 is the minimum, 100 the maximum.  Volumes of integer */
+/* values with a range of up to HIST_MAX_BINS use a sliding        */
+/* histogram, others a selection at each voxel                     */
+Raw_volume *rank_filter_kernel(Kernel * K, Raw_volume * vol, double p)
+{
+   rank_args_struct args;
+   progress_struct progress;
+   double   vmin, vmax;
+   long     i;
+   int      is_int;
+
+   if(p < 0.0){
+      p = 0.0;
+      }
+   if(p > 100.0){
+      p = 100.0;
+      }
+   if(K->nelems < 1){
+      return (vol);
+      }
+
+   /* check for integer data */
+   is_int = TRUE;
+   vmin = DBL_MAX;
+   vmax = -DBL_MAX;
+   for(i = 0; i < vol->nvox && is_int; i++){
+      if(vol->data[i] != floor(vol->data[i])){
+         is_int = FALSE;
+         }
+      if(vol->data[i] < vmin){
+         vmin = vol->data[i];
+         }
+      if(vol->data[i] > vmax){
+         vmax = vol->data[i];
+         }
+      }
+
+   args.K = K;
+   args.src = vol;
+   args.rank = (int)floor((K->nelems - 1) * p / 100.0 + 0.5);
+   args.use_hist = (is_int && vol->nvox > 0 && vmax - vmin < HIST_MAX_BINS);
+   args.vmin = vmin;
+   args.n_bins = (args.use_hist) ? (int)(vmax - vmin) + 1 : 0;
+   args.n_steps = window_steps(K, &args.step_offsets, &args.step_weights);
+   args.progress = &progress;
+
+   if(verbose){
+      fprintf(stdout, "Rank filter kernel - %g%% (rank %d of %d)", p, args.rank, K->nelems);
+      if(args.use_hist){
+         fprintf(stdout, ", histogram of %d bins, %d changes a step\n", args.n_bins,
+                 args.n_steps);
+         }
+      else {
+         fprintf(stdout, "\n");
+         }
+      }
+   initialize_progress_report(&progress, FALSE, vol->sizes[0], "Rank Filter");
+
+   /* write into the spare volume, starting from the padding */
+   args.dst = get_spare_raw_volume(vol);
+   copy_padding(K, args.src, args.dst);
+
+   run_slabs(rank_filter_slab, &args, -K->pre_pad[2], vol->sizes[0] - K->post_pad[2]);
+
+   FREE(args.step_offsets);
+   FREE(args.step_weights);
+   release_raw_volume(vol);
+   terminate_progress_report(&progress);
+   return (args.dst);
+   }
+
+/* should really only work on binary images    */
+/* from the original 2 pass Borgefors alg      */
+Raw_volume *distance_kernel(Kernel * K, Raw_volume * vol, double bg)
+{
+   int      x, y, z, c;
+   long     idx;
+   double   value, min;
+   int     *sizes = vol->sizes;
+   progress_struct progress;
+   Kernel  *k1, *k2;
+
+   /* split the Kernel */
+   k1 = new_kernel(K->nelems);
+   k2 = new_kernel(K->nelems);
+   split_kernel(K, k1, k2);
+
+   setup_pad_values(k1);
+   setup_pad_values(k2);
+   compile_kernel(k1, vol->strides);
+   compile_kernel(k2, vol->strides);
+
+   if(verbose){
+      fprintf(stdout, "Distance kernel - background %g\n", bg);
+      fprintf(stdout, "forward direction kernel:\n");
+      print_kernel(k1);
+      fprintf(stdout, "\nreverse direction kernel:\n");
+      print_kernel(k2);
+      }
+
+   initialize_progress_report(&progress, FALSE, sizes[2] * 2, "Distance");
+
+   /* forward raster direction */
    for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
       for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
          for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
 
-            if(get_volume_real_value(*vol, z, y, x, 0, 0) != bg){
+            idx = RAW_INDEX(vol, z, y, x);
+            if(vol->data[idx] != bg){
+
+               /* find the minimum */
+               min = DBL_MAX;
+               for(c = 0; c < k1->nelems; c++){
+                  value = vol->data[idx + k1->offsets[c]] + 1;
+                  if(value < min){
+                     min = value;
+                     }
+                  }
+
+               vol->data[idx] = min;
+               }
+            }
+         }
+      update_progress_report(&progress, z + 1);
+      }
+
+   /* reverse raster direction */
+   for(z = sizes[0] - k2->post_pad[2] - 1; z >= -k2->pre_pad[2]; z--){
+      for(y = sizes[1] - k2->post_pad[1] - 1; y >= -k2->pre_pad[1]; y--){
+         for(x = sizes[2] - k2->post_pad[0] - 1; x >= -k2->pre_pad[0]; x--){
+
+            idx = RAW_INDEX(vol, z, y, x);
+            min = vol->data[idx];
+            if(min != bg){
+
+               /* find the minimum distance to bg in the neighbouring vectors */
+               for(c = 0; c < k2->nelems; c++){
+                  value = vol->data[idx + k2->offsets[c]] + 1;
+                  if(value < min){
+                     min = value;
+                     }
+                  }
+
+               vol->data[idx] = min;
+               }
+            }
+         }
+      update_progress_report(&progress, sizes[2] + z + 1);
+      }
+
+   delete_kernel(k1);
+   delete_kernel(k2);
+   terminate_progress_report(&progress);
+   return (vol);
+   }
+
+/* structure for the arguments of the distance transform passes */
+typedef struct {
+   Raw_volume *vol;
+   int      axis;                      /* axis of the lines (z, y, x) */
+   int      first;                     /* first pass, sites are bg voxels */
+   int      last;                      /* last pass, write the root */
+   double   bg;
+   double   weight;                    /* squared separation along axis */
+   } edt_args_struct;
+
+/* f[q] = min over sites p of (weight * (q - p)^2 + f[p]) in place, as */
+/* the lower envelope of parabolas (Felzenszwalb and Huttenlocher).   */
+/* Entries of FLT_MAX are not sites.  v, z and g are work buffers of  */
+/* n, n + 1 and n entries                                             */
+static void edt_line(double *f, int n, double weight, int *v, double *z, double *g)
+{
+   int      q, k, j;
+   double   s;
+
+   k = -1;
+   s = 0.0;
+   for(q = 0; q < n; q++){
+      if(f[q] >= FLT_MAX){
+         continue;
+         }
+      while(k >= 0){
+         s = ((f[q] + weight * q * q) - (f[v[k]] + weight * v[k] * v[k])) /
+            (2.0 * weight * (q - v[k]));
+         if(s > z[k]){
+            break;
+            }
+         k--;
+         }
+      k++;
+      v[k] = q;
+      z[k] = (k == 0) ? -DBL_MAX : s;
+      z[k + 1] = DBL_MAX;
+      }
+
+   /* no sites on this line */
+   if(k < 0){
+      return;
+      }
+
+   for(q = 0; q < n; q++){
+      g[q] = f[q];
+      }
+   j = 0;
+   for(q = 0; q < n; q++){
+      while(z[j + 1] < q){
+         j++;
+         }
+      f[q] = weight * (q - v[j]) * (q - v[j]) + g[v[j]];
+      }
+   }
+
+/* distance transform of the lines along one axis, the slab    */
+/* [start, stop) is over the slowest of the other two axes      */
+static void edt_slab(void *arg, int start, int stop, int thread)
+{
+   edt_args_struct *args = (edt_args_struct *) arg;
+   Raw_volume *vol = args->vol;
+   int      n = vol->sizes[args->axis];
+   int      o1, o2, a, b, i;
+   int     *v;
+   long     stride, base;
+   double  *f, *z, *g;
+   float   *data;
+
+   /* the axes the lines are spread over */
+   o1 = (args->axis == 0) ? 1 : 0;
+   o2 = (args->axis == 2) ? 1 : 2;
+   stride = vol->strides[args->axis];
+
+   ALLOC(f, n);
+   ALLOC(g, n);
+   ALLOC(z, n + 1);
+   ALLOC(v, n);
+
+   for(a = start; a < stop; a++){
+      for(b = 0; b < vol->sizes[o2]; b++){
+         base = a * vol->strides[o1] + b * vol->strides[o2];
+         data = &vol->data[base];
+
+         for(i = 0; i < n; i++){
+            if(args->first){
+               f[i] = (data[i * stride] == args->bg) ? 0.0 : FLT_MAX;
+               }
+            else {
+               f[i] = data[i * stride];
+               }
+            }
+
+         edt_line(f, n, args->weight, v, z, g);
+
+         for(i = 0; i < n; i++){
+            if(args->last && f[i] < FLT_MAX){
+               data[i * stride] = sqrt(f[i]);
+               }
+            else {
+               data[i * stride] = (f[i] < FLT_MAX) ? f[i] : FLT_MAX;
+               }
+            }
+         }
+      }
+
+   FREE(f);
+   FREE(g);
+   FREE(z);
+   FREE(v);
+   }
+
+/* exact Euclidean distance transform, each voxel that is not bg is set */
+/* to its distance to the nearest bg voxel and bg voxels are set to 0.  */
+/* sep holds the voxel size (z, y, x) distances are measured in, it is  */
+/* done as a separable pass of squared distances along each axis        */
+Raw_volume *euclidean_distance(Raw_volume * vol, double bg, double sep[])
+{
+   int      axis;
+   long     i;
+   edt_args_struct args;
+
+   if(verbose){
+      fprintf(stdout, "Euclidean distance - background %g, voxel size [%g:%g:%g]\n", bg,
+              sep[0], sep[1], sep[2]);
+      }
+
+   args.vol = vol;
+   args.bg = bg;
+   for(axis = 2; axis >= 0; axis--){
+      args.axis = axis;
+      args.first = (axis == 2);
+      args.last = (axis == 0);
+      args.weight = sep[axis] * sep[axis];
+      run_slabs(edt_slab, &args, 0, vol->sizes[(axis == 0) ? 1 : 0]);
+      }
+
+   /* without any background there is nothing to measure to */
+   if(vol->nvox > 0 && vol->data[0] >= FLT_MAX){
+      fprintf(stderr, "euclidean_distance(): no background (%g) voxels found\n", bg);
+      for(i = 0; i < vol->nvox; i++){
+         vol->data[i] = 0.0;
+         }
+      }
+
+   return (vol);
+   }
+
+/* structure for the arguments of the Gaussian passes */
+typedef struct {
+   Raw_volume *vol;
+   int      axis;                      /* axis of the lines (z, y, x) */
+   double   c[4];                      /* gain and feedback of the filter */
+   } gauss_args_struct;
+
+/* variance of the forward and backward recursive filter with the */
+/* poles of the van Vliet, Young and Verbeek Gaussian scaled by q,  */
+/* a complex pair r e^(+-i t) and a real pole d, each adds          */
+/* 2 d / (d - 1)^2 over the two directions                          */
+static double gauss_variance(double q, double *r, double *t, double *d)
+{
+   double   re, im, den_re, den_im, den;
+
+   *r = pow(sqrt(1.41650 * 1.41650 + 1.00829 * 1.00829), 1.0 / q);
+   *t = atan2(1.00829, 1.41650) / q;
+   *d = pow(1.86543, 1.0 / q);
+
+   /* real part of p / (p - 1)^2 for the complex pole, twice */
+   re = *r * cos(*t);
+   im = *r * sin(*t);
+   den_re = (re - 1.0) * (re - 1.0) - im * im;
+   den_im = 2.0 * (re - 1.0) * im;
+   den = den_re * den_re + den_im * den_im;
+
+   return 2.0 * (2.0 * (re * den_re + im * den_im) / den + *d / ((*d - 1.0) * (*d - 1.0)));
+   }
+
+/* coefficients of the recursive Gaussian for a sigma (in voxels),   */
+/* the poles are scaled until the impulse response has that sigma.   */
+/* c[0] is the gain of the input and c[1..3] the feedback of the     */
+/* last three outputs                                                */
+static void gauss_coeffs(double sigma, double c[])
+{
+   int      i;
+   double   q, lo, hi, r, t, d;
+   double   a_re, a_im, a2, e;
+
+   lo = 0.01;
+   hi = 10.0 * sigma + 10.0;
+   for(i = 0; i < 100; i++){
+      q = 0.5 * (lo + hi);
+      if(gauss_variance(q, &r, &t, &d) < sigma * sigma){
+         lo = q;
+         }
+      else {
+         hi = q;
+         }
+      }
+   gauss_variance(q, &r, &t, &d);
+
+   /* (1 - a z^-1)(1 - conj(a) z^-1)(1 - e z^-1) with a and e the */
+   /* inverses of the poles                                       */
+   a_re = cos(t) / r;
+   a_im = -sin(t) / r;
+   a2 = a_re * a_re + a_im * a_im;
+   e = 1.0 / d;
+
+   c[1] = 2.0 * a_re + e;
+   c[2] = -(a2 + 2.0 * a_re * e);
+   c[3] = a2 * e;
+   c[0] = 1.0 - c[1] - c[2] - c[3];
+   }
+
+/* forward then backward recursive filter of n lines of width values */
+/* in place, line i starts at f[i * width].  The edges are continued */
+/* as constant, which the filter passes through unchanged            */
+static void gauss_lines(double *f, int n, long width, double c[], double *edge)
+{
+   int      i;
+   long     k;
+   double  *x, *p1, *p2, *p3;
+
+   for(k = 0; k < width; k++){
+      edge[k] = f[k];
+      }
+   for(i = 0; i < n; i++){
+      x = &f[i * width];
+      p1 = (i >= 1) ? x - width : edge;
+      p2 = (i >= 2) ? x - 2 * width : edge;
+      p3 = (i >= 3) ? x - 3 * width : edge;
+      for(k = 0; k < width; k++){
+         x[k] = c[0] * x[k] + c[1] * p1[k] + c[2] * p2[k] + c[3] * p3[k];
+         }
+      }
+
+   for(k = 0; k < width; k++){
+      edge[k] = f[(n - 1) * width + k];
+      }
+   for(i = n - 1; i >= 0; i--){
+      x = &f[i * width];
+      p1 = (i + 1 < n) ? x + width : edge;
+      p2 = (i + 2 < n) ? x + 2 * width : edge;
+      p3 = (i + 3 < n) ? x + 3 * width : edge;
+      for(k = 0; k < width; k++){
+         x[k] = c[0] * x[k] + c[1] * p1[k] + c[2] * p2[k] + c[3] * p3[k];
+         }
+      }
+   }
+
+/* Gaussian along one axis, the slab [start, stop) is over z for the */
+/* x and y passes and over y for the z pass.  Lines along y and z    */
+/* are filtered a whole sheet of x at a time                         */
+static void gauss_slab(void *arg, int start, int stop, int thread)
+{
+   gauss_args_struct *args = (gauss_args_struct *) arg;
+   Raw_volume *vol = args->vol;
+   int      n = vol->sizes[args->axis];
+   int      a, b, i, n_sheets;
+   long     k, width, stride, base;
+   double  *f, *edge;
+   float   *data;
+
+   /* rows along x are sheets of width 1 */
+   if(args->axis == 2){
+      width = 1;
+      n_sheets = vol->sizes[1];
+      }
+   else {
+      width = vol->sizes[2];
+      n_sheets = 1;
+      }
+   stride = vol->strides[args->axis];
+
+   ALLOC(f, n * width);
+   ALLOC(edge, width);
+
+   for(a = start; a < stop; a++){
+      for(b = 0; b < n_sheets; b++){
+         base = (args->axis == 0) ? a * vol->strides[1] :
+            a * vol->strides[0] + b * vol->strides[1];
+         data = &vol->data[base];
+
+         for(i = 0; i < n; i++){
+            for(k = 0; k < width; k++){
+               f[i * width + k] = data[i * stride + k];
+               }
+            }
+
+         gauss_lines(f, n, width, args->c, edge);
+
+         for(i = 0; i < n; i++){
+            for(k = 0; k < width; k++){
+               data[i * stride + k] = f[i * width + k];
+               }
+            }
+         }
+      }
+
+   FREE(f);
+   FREE(edge);
+   }
+
+/* Gaussian blur in place with a recursive filter along each axis, */
+/* the cost per voxel is the same whatever the width.  sigma is in  */
+/* voxels (z, y, x), axes with a sigma below 0.5 are left alone as  */
+/* three poles are a poor Gaussian there                            */
+Raw_volume *gaussian_blur(Raw_volume * vol, double sigma[])
+{
+   int      axis;
+   gauss_args_struct args;
+
+   if(verbose){
+      fprintf(stdout, "Gaussian blur - sigma [%g:%g:%g] voxels\n", sigma[0], sigma[1],
+              sigma[2]);
+      }
+
+   args.vol = vol;
+   for(axis = 2; axis >= 0; axis--){
+      if(sigma[axis] < 0.5 || vol->sizes[axis] < 2){
+         continue;
+         }
+      args.axis = axis;
+      gauss_coeffs(sigma[axis], args.c);
+      run_slabs(gauss_slab, &args, 0, vol->sizes[(axis == 0) ? 1 : 0]);
+      }
+
+   return (vol);
+   }
+
+/* union-find over provisional labels with union by rank and path */
+/* halving, label 0 is the background and is never used            */
+typedef struct {
+   unsigned int *parent;
+   unsigned int *count;                /* voxels given each label */
+   unsigned char *rank;
+   unsigned int n;                     /* labels in use (including 0) */
+   unsigned int size;                  /* labels allocated */
+   } Union_find;
+
+static void uf_init(Union_find * uf, unsigned int size)
+{
+   uf->size = (size < 2) ? 2 : size;
+   ALLOC(uf->parent, uf->size);
+   ALLOC(uf->count, uf->size);
+   ALLOC(uf->rank, uf->size);
+   uf->parent[0] = 0;
+   uf->count[0] = 0;
+   uf->rank[0] = 0;
+   uf->n = 1;
+   }
+
+static void uf_free(Union_find * uf)
+{
+   FREE(uf->parent);
+   FREE(uf->count);
+   FREE(uf->rank);
+   }
+
+/* a new label in a set of its own, the arrays grow geometrically */
+static unsigned int uf_new_label(Union_find * uf)
+{
+   unsigned int label;
+
+   if(uf->n == uf->size){
+      if(uf->size > UINT_MAX / 2){
+         print_error("group_kernel(): too many provisional labels\n");
+         exit(EXIT_FAILURE);
+         }
+      uf->size *= 2;
+      uf->parent = (unsigned int *)realloc(uf->parent, uf->size * sizeof(unsigned int));
+      uf->count = (unsigned int *)realloc(uf->count, uf->size * sizeof(unsigned int));
+      uf->rank = (unsigned char *)realloc(uf->rank, uf->size * sizeof(unsigned char));
+      if(uf->parent == NULL || uf->count == NULL || uf->rank == NULL){
+         print_error("group_kernel(): could not allocate %u labels\n", uf->size);
+         exit(EXIT_FAILURE);
+         }
+      }
+
+   label = uf->n++;
+   uf->parent[label] = label;
+   uf->count[label] = 0;
+   uf->rank[label] = 0;
+   return label;
+   }
+
+static unsigned int uf_find(Union_find * uf, unsigned int a)
+{
+   while(uf->parent[a] != a){
+      uf->parent[a] = uf->parent[uf->parent[a]];
+      a = uf->parent[a];
+      }
+   return a;
+   }
+
+/* merge the sets of a and b, returns the root of the result */
+static unsigned int uf_union(Union_find * uf, unsigned int a, unsigned int b)
+{
+   a = uf_find(uf, a);
+   b = uf_find(uf, b);
+   if(a == b){
+      return a;
+      }
+   if(uf->rank[a] < uf->rank[b]){
+      uf->parent[a] = b;
+      return b;
+      }
+   if(uf->rank[a] == uf->rank[b]){
+      uf->rank[a]++;
+      }
+   uf->parent[b] = a;
+   return a;
+   }
 
-               /* find the minimum */
-               min = DBL_MAX;
-               for(c = 0; c < k1->nelems; c++){
-                  value = get_volume_real_value(*vol,
-                                                z + k1->K[c][2],
-                                                y + k1->K[c][1],
-                                                x + k1->K[c][0],
-                                                0 + k1->K[c][3], 0 + k1->K[c][4]) + 1;
-                  if(value < min){
-                     min = value;
+/* label of a voxel from its labelled neighbours at the offsets, */
+/* merging their sets.  Neighbours in slices before zmin (dz     */
+/* relative to the voxel) are skipped.  Returns 0 if none are    */
+/* labelled                                                      */
+static unsigned int merge_neighbours(Union_find * uf, unsigned int *labels, long idx,
+                                     int n, int *offsets, int *dz, int zmin)
+{
+   int      c;
+   unsigned int label, nbr;
+
+   label = 0;
+   for(c = 0; c < n; c++){
+      if(dz[c] < zmin){
+         continue;
+         }
+      nbr = labels[idx + offsets[c]];
+      if(nbr == 0 || nbr == label){
+         continue;
+         }
+      label = (label == 0) ? nbr : uf_union(uf, label, nbr);
+      }
+   return label;
+   }
+
+/* root of a label in a union-find shared between threads */
+static unsigned int shared_find(unsigned int *parent, unsigned int a)
+{
+   unsigned int p, gp;
+
+   for(;;){
+      p = __atomic_load_n(&parent[a], __ATOMIC_ACQUIRE);
+      if(p == a){
+         return a;
+         }
+      gp = __atomic_load_n(&parent[p], __ATOMIC_ACQUIRE);
+      if(gp != p){
+         __atomic_compare_exchange_n(&parent[a], &p, gp, FALSE,
+                                     __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+         }
+      a = gp;
+      }
+   }
+
+/* merge the sets of a and b in a shared union-find, the higher root */
+/* is always linked under the lower so the result does not depend on */
+/* the order the threads get here in                                 */
+static void shared_union(unsigned int *parent, unsigned int a, unsigned int b)
+{
+   unsigned int lo, hi;
+
+   for(;;){
+      a = shared_find(parent, a);
+      b = shared_find(parent, b);
+      if(a == b){
+         return;
+         }
+      lo = (a < b) ? a : b;
+      hi = (a < b) ? b : a;
+      if(__atomic_compare_exchange_n(&parent[hi], &hi, lo, FALSE,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+         return;
+         }
+      }
+   }
+
+/* structure for the arguments of the group labelling passes */
+typedef struct {
+   Raw_volume *vol;
+   Kernel  *k1;
+   double   bg;
+   int      is_box26;
+   int      prev_off;
+   int      up_off;
+   int      next_row_off[3];
+   int      lo[3];                     /* scan range (z, y, x) */
+   int      hi[3];
+   unsigned int *labels;               /* provisional, local to each slab */
+   Union_find *uf;                     /* per slab */
+   int     *slab_start;                /* per slab */
+   int     *slab_stop;
+   unsigned int *base;                 /* per slab, global label = base + local */
+   unsigned int *zbase;                /* per slice, base of its slab */
+   Union_find global;
+   unsigned int *trans;
+   Group_stats *stats;                 /* per thread, by final label */
+   progress_struct *progress;
+   } group_args_struct;
+
+/* label the z-slab [start, stop) on its own, neighbours in earlier */
+/* slabs are left for group_merge_slab()                            */
+static void group_scan_slab(void *arg, int start, int stop, int thread)
+{
+   group_args_struct *args = (group_args_struct *) arg;
+   Raw_volume *vol = args->vol;
+   Kernel  *k1 = args->k1;
+   Union_find *uf = &args->uf[thread];
+   unsigned int *labels = args->labels;
+   int      x, y, z, c;
+   long     idx, row;
+   unsigned int label, nbr;
+
+   uf_init(uf, 1024);
+   args->slab_start[thread] = start;
+   args->slab_stop[thread] = stop;
+
+   for(z = start; z < stop; z++){
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         row = RAW_INDEX(vol, z, y, 0);
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+
+            idx = row + x;
+            if(vol->data[idx] == args->bg){
+               continue;
+               }
+
+            if(args->is_box26 && z > start){
+               label = labels[idx + args->prev_off];
+               if(label == 0){
+                  label = labels[idx + args->up_off];
+                  if(label != 0){
+
+                     /* the middle of the next row touches both ends, */
+                     /* but the two ends don't touch each other       */
+                     nbr = labels[idx + args->next_row_off[1]];
+                     if(nbr != 0){
+                        if(nbr != label){
+                           label = uf_union(uf, label, nbr);
+                           }
+                        }
+                     else {
+                        for(c = 0; c < 3; c += 2){
+                           nbr = labels[idx + args->next_row_off[c]];
+                           if(nbr != 0 && nbr != label){
+                              label = uf_union(uf, label, nbr);
+                              }
+                           }
+                        }
+                     }
+                  else {
+                     label = merge_neighbours(uf, labels, idx, k1->nelems, k1->offsets,
+                                              k1->dz, start - z);
                      }
                   }
+               }
+            else {
+               label = merge_neighbours(uf, labels, idx, k1->nelems, k1->offsets,
+                                        k1->dz, start - z);
+               }
 
-               set_volume_real_value(*vol, z, y, x, 0, 0, min);
+            /* no neighbours, make a new label */
+            if(label == 0){
+               label = uf_new_label(uf);
                }
+            labels[idx] = label;
+            uf->count[label]++;
             }
          }
-      update_progress_report(&progress, z + 1);
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
       }
+   }
 
-   /* reverse raster direction */
-   for(z = sizes[0] - k2->post_pad[2] - 1; z >= -k2->pre_pad[2]; z--){
-      for(y = sizes[1] - k2->post_pad[1] - 1; y >= -k2->pre_pad[1]; y--){
-         for(x = sizes[2] - k2->post_pad[0] - 1; x >= -k2->pre_pad[0]; x--){
+/* copy the sets of slabs [start, stop) into the global union-find */
+static void group_global_slab(void *arg, int start, int stop, int thread)
+{
+   group_args_struct *args = (group_args_struct *) arg;
+   Union_find *uf;
+   unsigned int label, base;
+   int      t, z;
+
+   for(t = start; t < stop; t++){
+      uf = &args->uf[t];
+      base = args->base[t];
+      for(label = 1; label < uf->n; label++){
+         args->global.parent[base + label] = base + uf_find(uf, label);
+         args->global.count[base + label] = uf->count[label];
+         args->global.rank[base + label] = 0;
+         }
+      for(z = args->slab_start[t]; z < args->slab_stop[t]; z++){
+         args->zbase[z] = base;
+         }
+      uf_free(uf);
+      }
+   }
 
-            min = get_volume_real_value(*vol, z, y, x, 0, 0);
-            if(min != bg){
+/* merge the sets of slabs [start, stop) with those of the slabs */
+/* before them across the slab boundaries                        */
+static void group_merge_slab(void *arg, int start, int stop, int thread)
+{
+   group_args_struct *args = (group_args_struct *) arg;
+   Raw_volume *vol = args->vol;
+   Kernel  *k1 = args->k1;
+   unsigned int *labels = args->labels;
+   int      x, y, z, c, t, z0, z1;
+   long     idx, row;
+   unsigned int label, nbr;
+
+   for(t = start; t < stop; t++){
+      z0 = args->slab_start[t];
+      z1 = z0 - k1->pre_pad[2];
+      if(z1 > args->slab_stop[t]){
+         z1 = args->slab_stop[t];
+         }
 
-               /* find the minimum distance to bg in the neighbouring vectors */
-               for(c = 0; c < k2->nelems; c++){
-                  value = get_volume_real_value(*vol,
-                                                z + k2->K[c][2],
-                                                y + k2->K[c][1],
-                                                x + k2->K[c][0],
-                                                0 + k2->K[c][3], 0 + k2->K[c][4]) + 1;
-                  if(value < min){
-                     min = value;
+      for(z = z0; z < z1; z++){
+         for(y = args->lo[1]; y < args->hi[1]; y++){
+            row = RAW_INDEX(vol, z, y, 0);
+            for(x = args->lo[2]; x < args->hi[2]; x++){
+
+               idx = row + x;
+               label = labels[idx];
+               if(label == 0){
+                  continue;
+                  }
+
+               for(c = 0; c < k1->nelems; c++){
+                  if(z + k1->dz[c] >= z0){
+                     continue;
+                     }
+                  nbr = labels[idx + k1->offsets[c]];
+                  if(nbr != 0){
+                     shared_union(args->global.parent, args->zbase[z] + label,
+                                  args->zbase[z + k1->dz[c]] + nbr);
                      }
                   }
+               }
+            }
+         }
+      }
+   }
 
-               set_volume_real_value(*vol, z, y, x, 0, 0, min);
+/* write the final group numbers of the z-slab [start, stop), */
+/* gathering the statistics of each group on the way if asked   */
+static void group_write_slab(void *arg, int start, int stop, int thread)
+{
+   group_args_struct *args = (group_args_struct *) arg;
+   Raw_volume *vol = args->vol;
+   Group_stats stats, s;
+   long     idx, row;
+   unsigned int base, label;
+   int      x, y, z, i;
+   int      pos[3];
+
+   stats = (args->stats == NULL) ? NULL : args->stats[thread];
+   for(z = start; z < stop; z++){
+      base = args->zbase[z];
+      for(y = 0; y < vol->sizes[1]; y++){
+         row = RAW_INDEX(vol, z, y, 0);
+         for(x = 0; x < vol->sizes[2]; x++){
+            idx = row + x;
+            label = (args->labels[idx] == 0) ? 0 : args->trans[base + args->labels[idx]];
+
+            if(label != 0 && stats != NULL){
+               s = &stats[label];
+               s->count++;
+               s->sum += vol->data[idx];
+               pos[0] = z;
+               pos[1] = y;
+               pos[2] = x;
+               for(i = 0; i < 3; i++){
+                  s->pos_sum[i] += pos[i];
+                  if(pos[i] < s->lo[i]){
+                     s->lo[i] = pos[i];
+                     }
+                  if(pos[i] > s->hi[i]){
+                     s->hi[i] = pos[i];
+                     }
+                  }
                }
+            args->labels[idx] = label;
             }
          }
-      update_progress_report(&progress, sizes[2] + z + 1);
       }
+   }
 
-   free(k1);
-   free(k2);
-   terminate_progress_report(&progress);
-   return (vol);
+/* empty statistics for labels [0, n) */
+static Group_stats new_group_stats(int n)
+{
+   Group_stats stats;
+   int      c, i;
+
+   ALLOC(stats, n);
+   for(c = 0; c < n; c++){
+      stats[c].count = 0;
+      stats[c].sum = 0.0;
+      for(i = 0; i < 3; i++){
+         stats[c].pos_sum[i] = 0.0;
+         stats[c].lo[i] = INT_MAX;
+         stats[c].hi[i] = -1;
+         }
+      }
+   return stats;
    }
 
 /* do connected components labelling on a volume */
 /* resulting groups are sorted WRT size          */
-Volume  *group_kernel(Kernel * K, Volume * vol, double bg)
+/* provisional labels are merged with a union-find in a raster scan    */
+/* over the forward half of the kernel.  For a 3x3x3 kernel the scan   */
+/* uses a decision tree: the neighbour in the previous slice touches   */
+/* the 12 others and the one in the previous row touches all but the   */
+/* next row of the previous slice.  The middle of that row touches its */
+/* ends but the ends don't touch each other, so it takes one merge if  */
+/* the middle is set and up to two if not.                             */
+/* Each thread scans a z-slab with labels of its own, these are then   */
+/* numbered globally and the sets joined across the slab boundaries.   */
+/* Global labels still increase in raster order so the lowest label of */
+/* a group is its first voxel and the output is the same for any       */
+/* number of threads.                                                  */
+/* Groups smaller than min_size voxels and all but the largest         */
+/* max_groups (0 for all) are set to 0.  If stats is not NULL it is    */
+/* set to the statistics of the n_stats groups left (from pass 2).     */
+/* The labels are handed back as a label volume so they stay exact.    */
+Raw_volume *group_kernel(Kernel * K, Raw_volume * vol, double bg,
+                         unsigned int min_size, unsigned int max_groups,
+                         Group_stats * stats, int *n_stats)
 {
-   int      x, y, z;
-   int      sizes[MAX_VAR_DIMS];
+   int      c, i, t, n_slabs;
+   int      b0[3], b1[3];
    progress_struct progress;
-   Volume   tmp_vol;
    Kernel  *k1, *k2;
+   group_args_struct args;
+   Raw_volume *lvol;
 
-   unsigned int *equiv;
-   unsigned int *counts;
-   unsigned int *trans;
-   unsigned int neighbours[K->nelems];
-
-   /* counters */
-   unsigned int c;
-   unsigned int value;
-   unsigned int group_idx;             /* label for the next group     */
-   unsigned int num_groups;
-
-   unsigned int min_label;
-   unsigned int curr_label;
-   unsigned int prev_label;
-   unsigned int num_matches;
+   unsigned int *group_id;
+   unsigned int *order;
+   unsigned int label, nbr, n_labels;
+   unsigned int num_groups, n_keep;
 
    /* structure for group data */
-   Group_info *group_data;
+   Group_info group_data;
 
    /* split the Kernel into forward and backwards kernels */
    k1 = new_kernel(K->nelems);
@@ -561,6 +3539,8 @@ Volume  *group_kernel(Kernel * K, Volume * vol, double bg)
 
    setup_pad_values(k1);
    setup_pad_values(k2);
+   compile_kernel(k1, vol->strides);
+   compile_kernel(k2, vol->strides);
 
    if(verbose){
       fprintf(stdout, "Group kernel - background %g\n", bg);
@@ -570,289 +3550,518 @@ Volume  *group_kernel(Kernel * K, Volume * vol, double bg)
       print_kernel(k2);
       }
 
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Groups");
+   args.vol = vol;
+   args.k1 = k1;
+   args.bg = bg;
+   args.progress = &progress;
+   for(c = 0; c < 3; c++){
+      args.lo[c] = -k1->pre_pad[2 - c];
+      args.hi[c] = vol->sizes[c] - k1->post_pad[2 - c];
+      }
 
-   /* copy and then zero out the original volume */
-   tmp_vol = copy_volume(*vol);
-   for(z = sizes[0]; z--;){
-      for(y = sizes[1]; y--;){
-         for(x = sizes[2]; x--;){
-            set_volume_voxel_value(*vol, z, y, x, 0, 0, 0);
-            }
-         }
+   /* the decision tree offsets of a 3x3x3 kernel */
+   args.is_box26 = get_kernel_box(K, b0, b1) &&
+      b0[0] == -1 && b0[1] == -1 && b0[2] == -1 && b1[0] == 1 && b1[1] == 1 && b1[2] == 1;
+   args.prev_off = -vol->strides[0];
+   args.up_off = -vol->strides[1];
+   for(c = 0; c < 3; c++){
+      args.next_row_off[c] = -vol->strides[0] + vol->strides[1] + (c - 1);
       }
 
-   /* pass 1 - forward direction (we assume a symmetric kernel) */
+   /* provisional labels, 0 is the background.  The final labels */
+   /* are written over them and handed back as they are           */
+   lvol = new_label_volume(vol->sizes);
+   args.labels = lvol->labels;
+   ALLOC(args.uf, n_threads);
+   ALLOC(args.slab_start, n_threads);
+   ALLOC(args.slab_stop, n_threads);
+   ALLOC(args.base, n_threads);
+   for(t = 0; t < n_threads; t++){
+      args.slab_start[t] = -1;
+      }
 
-   /* our first group is given the label 1 */
-   group_idx = 1;
+   /* pass 1 - forward direction (we assume a symmetric kernel) */
+   initialize_progress_report(&progress, FALSE, vol->sizes[0], "Groups");
+   run_slabs(group_scan_slab, &args, args.lo[0], args.hi[0]);
+   terminate_progress_report(&progress);
 
-   /* initialise the equiv and counts arrays */
-   SET_ARRAY_SIZE(equiv, 0, group_idx, 500);
-   equiv[0] = 0;
+   /* number the labels of each slab after those of the slabs before */
+   n_labels = 1;
+   for(n_slabs = 0; n_slabs < n_threads && args.slab_start[n_slabs] >= 0; n_slabs++){
+      args.base[n_slabs] = n_labels - 1;
+      if(args.uf[n_slabs].n - 1 > UINT_MAX - n_labels){
+         print_error("group_kernel(): too many provisional labels\n");
+         exit(EXIT_FAILURE);
+         }
+      n_labels += args.uf[n_slabs].n - 1;
+      }
+   uf_init(&args.global, n_labels);
+   args.global.n = n_labels;
+   ALLOC(args.zbase, vol->sizes[0]);
+   for(c = 0; c < vol->sizes[0]; c++){
+      args.zbase[c] = 0;
+      }
+   run_slabs(group_global_slab, &args, 0, n_slabs);
+   run_slabs(group_merge_slab, &args, 1, n_slabs);
+
+   /* number the groups in the order they were first found, the  */
+   /* lowest provisional label of a group is its first voxel     */
+   ALLOC(group_id, n_labels);
+   for(label = 0; label < n_labels; label++){
+      group_id[label] = 0;
+      }
+   num_groups = 0;
+   for(label = 1; label < n_labels; label++){
+      nbr = uf_find(&args.global, label);
+      if(group_id[nbr] == 0){
+         group_id[nbr] = ++num_groups;
+         }
+      }
 
-   SET_ARRAY_SIZE(counts, 0, group_idx, 500);
-   counts[0] = 0;
+   /* Allocate space for the array of groups */
+   ALLOC(group_data, num_groups + 1);
+   for(c = 0; c < num_groups; c++){
+      group_data[c].orig_label = c + 1;
+      group_data[c].count = 0;
+      }
+   for(label = 1; label < n_labels; label++){
+      group_data[group_id[uf_find(&args.global, label)] - 1].count +=
+         args.global.count[label];
+      }
 
-   for(z = -k1->pre_pad[2]; z < sizes[0] - k1->post_pad[2]; z++){
-      for(y = -k1->pre_pad[1]; y < sizes[1] - k1->post_pad[1]; y++){
-         for(x = -k1->pre_pad[0]; x < sizes[2] - k1->post_pad[0]; x++){
+   /* sort the groups by the count size */
+   if(verbose){
+      fprintf(stdout, "Found %d unique groups from %d, sorting...\n", num_groups, n_labels);
+      }
+   qsort(group_data, num_groups, sizeof(group_info_struct), &compare_groups);
 
-            if(get_volume_voxel_value(tmp_vol, z, y, x, 0, 0) != bg){
+   /* the groups kept are the largest ones */
+   n_keep = num_groups;
+   if(max_groups > 0 && n_keep > max_groups){
+      n_keep = max_groups;
+      }
+   while(n_keep > 0 && group_data[n_keep - 1].count < min_size){
+      n_keep--;
+      }
+   if(verbose && n_keep < num_groups){
+      fprintf(stdout, "Keeping the largest %d groups (%d voxels and up)\n", n_keep,
+              (n_keep > 0) ? group_data[n_keep - 1].count : 0);
+      }
 
-               /* search this voxels neighbours */
-               num_matches = 0;
-               min_label = INT_MAX;
+   /* set up the transpose array, +1 to bump past 0 */
+   ALLOC(order, num_groups + 1);
+   for(c = 0; c < num_groups; c++){
+      order[group_data[c].orig_label] = (c < n_keep) ? c + 1 : 0;
+      }
+   ALLOC(args.trans, n_labels);
+   args.trans[0] = 0;
+   for(label = 1; label < n_labels; label++){
+      args.trans[label] = order[group_id[uf_find(&args.global, label)]];
+      }
 
-               for(c = 0; c < k1->nelems; c++){
-                  value = (unsigned int)get_volume_voxel_value(*vol,
-                                                               z + k1->K[c][2],
-                                                               y + k1->K[c][1],
-                                                               x + k1->K[c][0],
-                                                               0 + k1->K[c][3],
-                                                               0 + k1->K[c][4]);
-                  if(value != 0){
-                     if(value < min_label){
-                        min_label = value;
-                        }
-                     neighbours[num_matches] = value;
-                     num_matches++;
-                     }
+   /* pass 2 - resolve equivalences in the output data */
+   if(verbose){
+      fprintf(stdout, "Resolving equivalences...\n");
+      }
+   args.stats = NULL;
+   if(stats != NULL){
+      ALLOC(args.stats, n_threads);
+      for(t = 0; t < n_threads; t++){
+         args.stats[t] = new_group_stats(n_keep + 1);
+         }
+      }
+   run_slabs(group_write_slab, &args, 0, vol->sizes[0]);
+
+   /* sum up the statistics of each thread */
+   if(stats != NULL){
+      *stats = new_group_stats(n_keep);
+      *n_stats = n_keep;
+      for(t = 0; t < n_threads; t++){
+         for(c = 0; c < n_keep; c++){
+            (*stats)[c].count += args.stats[t][c + 1].count;
+            (*stats)[c].sum += args.stats[t][c + 1].sum;
+            for(i = 0; i < 3; i++){
+               (*stats)[c].pos_sum[i] += args.stats[t][c + 1].pos_sum[i];
+               if(args.stats[t][c + 1].lo[i] < (*stats)[c].lo[i]){
+                  (*stats)[c].lo[i] = args.stats[t][c + 1].lo[i];
                   }
+               if(args.stats[t][c + 1].hi[i] > (*stats)[c].hi[i]){
+                  (*stats)[c].hi[i] = args.stats[t][c + 1].hi[i];
+                  }
+               }
+            }
+         FREE(args.stats[t]);
+         }
+      FREE(args.stats);
+      }
 
-               switch (num_matches){
-               case 0:
-                  /* no neighbours, make a new label and increment */
-                  set_volume_voxel_value(*vol, z, y, x, 0, 0, (Real) group_idx);
-
-                  SET_ARRAY_SIZE(equiv, group_idx, group_idx + 1, 500);
-                  equiv[group_idx] = group_idx;
-
-                  SET_ARRAY_SIZE(counts, group_idx, group_idx + 1, 500);
-                  counts[group_idx] = 1;
+   /* tidy up */
+   release_raw_volume(vol);
+   FREE(args.uf);
+   FREE(args.slab_start);
+   FREE(args.slab_stop);
+   FREE(args.base);
+   FREE(args.zbase);
+   FREE(args.trans);
+   FREE(group_id);
+   FREE(group_data);
+   FREE(order);
+   uf_free(&args.global);
+   delete_kernel(k1);
+   delete_kernel(k2);
+
+   return (lvol);
+   }
 
-                  group_idx++;
-                  break;
+/* structure for the arguments of the local correlation passes */
+typedef struct {
+   Kernel  *K;
+   Raw_volume *src;
+   Raw_volume **cmp;                   /* volumes compared to */
+   Raw_volume **dst;                   /* and their maps */
+   int      n_cmp;
+   int      target;                    /* the one a box pass is on */
+   int      b0[3];                     /* box extent (z, y, x) */
+   int      b1[3];
+   int      lo[3];                     /* output range (z, y, x) */
+   int      hi[3];
+   progress_struct *progress;
+   } lcorr_args_struct;
+
+/* local correlation of the z-slab [start, stop) to all the compare */
+/* volumes at once, each source voxel is read once for all of them  */
+static void lcorr_slab(void *arg, int start, int stop, int thread)
+{
+   lcorr_args_struct *args = (lcorr_args_struct *) arg;
+   Kernel  *K = args->K;
+   int      x, y, z, c, k;
+   long     idx, row;
+   double   value, v1, v2;
+   double   ssum_v1, denom;
+   double  *ssum_v2, *sum_prd;
 
-               case 1:
-                  /* only one neighbour, no equivalences needed */
-                  set_volume_voxel_value(*vol, z, y, x, 0, 0, (Real) min_label);
-                  counts[min_label]++;
-                  break;
+   ALLOC(ssum_v2, args->n_cmp);
+   ALLOC(sum_prd, args->n_cmp);
 
-               default:
-                  /* more than one neighbour */
-
-                  /* first sort the neighbours array */
-                  qsort(&neighbours[0], (size_t) num_matches, sizeof(unsigned int),
-                        &compare_ints);
-
-                  /* find the minimum possible label for this voxel,    */
-                  /* this is done by descending through each neighbours */
-                  /* equivalences until an equivalence equal to itself  */
-                  /* is found                                           */
-                  prev_label = -1;
-                  for(c = 0; c < num_matches; c++){
-                     curr_label = neighbours[c];
-
-                     /* recurse this label if we haven't yet */
-                     if(curr_label != prev_label){
-                        while(equiv[curr_label] != equiv[equiv[curr_label]]){
-                           curr_label = equiv[curr_label];
-                           }
+   for(z = start; z < stop; z++){
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         row = RAW_INDEX(args->src, z, y, 0);
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+            
+            /* init counters */
+            ssum_v1 = 0;
+            for(k = 0; k < args->n_cmp; k++){
+               ssum_v2[k] = sum_prd[k] = 0;
+               }
+            for(c = 0; c < K->nelems; c++){
+               idx = row + x + K->offsets[c];
+               v1 = args->src->data[idx] * K->coeffs[c];
+               ssum_v1 += v1*v1;
+               
+               /* increment counters */
+               for(k = 0; k < args->n_cmp; k++){
+                  v2 = args->cmp[k]->data[idx] * K->coeffs[c];
+                  ssum_v2[k] += v2*v2;
+                  sum_prd[k] += v1*v2;
+                  }
+               }
+            
+            for(k = 0; k < args->n_cmp; k++){
+               denom = sqrt(ssum_v1 * ssum_v2[k]);
+               value = (denom == 0.0) ? 0.0 : sum_prd[k] / denom;
+               args->dst[k]->data[row + x] = value;
+               }
+            }
+         }
 
-                        /* check against the current minimum value */
-                        if(equiv[curr_label] < min_label){
-                           min_label = equiv[curr_label];
-                           }
-                        }
+      if(thread == 0){
+         update_progress_report(args->progress, z + 1);
+         }
+      }
 
-                     prev_label = neighbours[c];
-                     }
+   FREE(ssum_v2);
+   FREE(sum_prd);
+   }
 
-                  /* repeat, setting equivalences to the min_label */
-                  prev_label = -1;
-                  for(c = 0; c < num_matches; c++){
-                     curr_label = neighbours[c];
+/* check if a kernel is a full box of equal non-zero coefficients,  */
+/* if so return its extent in b0 and b1 (z, y, x).  The centre does */
+/* not count here as local correlation only reads the elements      */
+static int get_lcorr_box(Kernel * K, int b0[], int b1[])
+{
+   int      c, n, d, box_size, count;
+   long     idx;
+   char    *filled;
 
-                     if(curr_label != prev_label){
-                        while(equiv[curr_label] != equiv[equiv[curr_label]]){
-                           curr_label = equiv[curr_label];
+   if(K->nelems < 1 || K->coeffs[0] == 0.0){
+      return FALSE;
+      }
+   for(c = 0; c < K->nelems; c++){
+      if(K->coeffs[c] != K->coeffs[0]){
+         return FALSE;
+         }
+      }
 
-                           equiv[curr_label] = min_label;
-                           }
+   box_size = 1;
+   for(n = 0; n < 3; n++){
+      b0[n] = INT_MAX;
+      b1[n] = INT_MIN;
+      for(c = 0; c < K->nelems; c++){
+         d = (n == 0) ? K->dz[c] : (n == 1) ? K->dy[c] : K->dx[c];
+         if(d < b0[n]){
+            b0[n] = d;
+            }
+         if(d > b1[n]){
+            b1[n] = d;
+            }
+         }
+      box_size *= b1[n] - b0[n] + 1;
+      }
+   if(K->nelems != box_size){
+      return FALSE;
+      }
 
-                        /* set the label itself */
-                        if(equiv[neighbours[c]] != min_label){
-                           equiv[neighbours[c]] = min_label;
-                           }
-                        }
+   /* a repeated element would leave a hole elsewhere */
+   filled = (char *)calloc(box_size, sizeof(char));
+   count = 0;
+   for(c = 0; c < K->nelems; c++){
+      idx = ((long)(K->dz[c] - b0[0]) * (b1[1] - b0[1] + 1) + (K->dy[c] - b0[1]))
+         * (b1[2] - b0[2] + 1) + (K->dx[c] - b0[2]);
+      if(!filled[idx]){
+         filled[idx] = 1;
+         count++;
+         }
+      }
+   free(filled);
 
-                     prev_label = neighbours[c];
-                     }
+   return (count == box_size);
+   }
 
-                  /* finally set the voxel in question to the minimum value */
-                  set_volume_voxel_value(*vol, z, y, x, 0, 0, (Real) min_label);
-                  counts[min_label]++;
-                  break;
-                  }                       /* end case */
+/* the terms summed for local correlation of one pair of voxels */
+static void lcorr_terms(double t[], float a, float b)
+{
+   t[0] = (double)a * a;
+   t[1] = (double)b * b;
+   t[2] = (double)a * b;
+   t[3] = (a != 0.0);
+   t[4] = (b != 0.0);
+   }
 
-               }
+/* sums over the x and y extent of the box for every output voxel of */
+/* slice z, plane holds LCORR_SUMS slices, xsum is scratch the same  */
+/* size and acc LCORR_SUMS rows of the volume                        */
+static void lcorr_plane(lcorr_args_struct *args, int z, float *plane,
+                        float *xsum, double *acc)
+{
+   int     *sizes = args->src->sizes;
+   int     *b0 = args->b0;
+   int     *b1 = args->b1;
+   int      x, y, k;
+   long     slice, row, idx;
+   float   *a, *b;
+   double   s[LCORR_SUMS], t[LCORR_SUMS];
+
+   slice = (long)sizes[1] * sizes[2];
+
+   /* running sums along x of every row the y sums need */
+   for(y = args->lo[1] + b0[1]; y < args->hi[1] + b1[1]; y++){
+      row = RAW_INDEX(args->src, z, y, 0);
+      a = &args->src->data[row];
+      b = &args->cmp[args->target]->data[row];
+      idx = (long)y * sizes[2];
+
+      for(k = 0; k < LCORR_SUMS; k++){
+         s[k] = 0.0;
+         }
+      for(x = args->lo[2] + b0[2]; x < args->lo[2] + b1[2]; x++){
+         lcorr_terms(t, a[x], b[x]);
+         for(k = 0; k < LCORR_SUMS; k++){
+            s[k] += t[k];
+            }
+         }
+      for(x = args->lo[2]; x < args->hi[2]; x++){
+         lcorr_terms(t, a[x + b1[2]], b[x + b1[2]]);
+         for(k = 0; k < LCORR_SUMS; k++){
+            s[k] += t[k];
+            xsum[k * slice + idx + x] = s[k];
+            }
+         lcorr_terms(t, a[x + b0[2]], b[x + b0[2]]);
+         for(k = 0; k < LCORR_SUMS; k++){
+            s[k] -= t[k];
             }
          }
-      update_progress_report(&progress, z + 1);
       }
-   terminate_progress_report(&progress);
-
-   /* reduce the equiv and counts array */
-   num_groups = 0;
-   for(c = 0; c < group_idx; c++){
-
-      /* if this equivalence is not resolved yet */
-      if(c != equiv[c]){
 
-         /* find the min label value */
-         min_label = equiv[c];
-         while(min_label != equiv[min_label]){
-            min_label = equiv[min_label];
+   /* then running sums of those rows along y */
+   for(k = 0; k < LCORR_SUMS; k++){
+      for(x = args->lo[2]; x < args->hi[2]; x++){
+         acc[k * sizes[2] + x] = 0.0;
+         }
+      for(y = args->lo[1] + b0[1]; y < args->lo[1] + b1[1]; y++){
+         idx = k * slice + (long)y * sizes[2];
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+            acc[k * sizes[2] + x] += xsum[idx + x];
             }
-
-         /* update the label and its counters */
-         equiv[c] = min_label;
-         counts[min_label] += counts[c];
-         counts[c] = 0;
          }
-      else {
-         num_groups++;
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         idx = k * slice + (long)y * sizes[2];
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+            acc[k * sizes[2] + x] += xsum[idx + b1[1] * sizes[2] + x];
+            plane[idx + x] = acc[k * sizes[2] + x];
+            acc[k * sizes[2] + x] -= xsum[idx + b0[1] * sizes[2] + x];
+            }
          }
       }
+   }
 
-   /* Allocate space for the array of groups */
-   group_data = (Group_info *) malloc(num_groups * sizeof(Group_info));
-
-   num_groups = 0;
-   for(c = 0; c < group_idx; c++){
-      if(counts[c] > 0){
-         /* allocate space for this element */
-         group_data[num_groups] = malloc(sizeof(group_info_struct));
-
-         group_data[num_groups]->orig_label = equiv[c];
-         group_data[num_groups]->count = counts[c];
-         num_groups++;
+/* add (sign 1) or remove (sign -1) a plane of box sums from acc */
+static void lcorr_accumulate(lcorr_args_struct *args, double *acc, float *plane, int sign)
+{
+   int     *sizes = args->src->sizes;
+   int      x, y, k;
+   long     slice, idx;
+
+   slice = (long)sizes[1] * sizes[2];
+   for(k = 0; k < LCORR_SUMS; k++){
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         idx = k * slice + (long)y * sizes[2];
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+            acc[idx + x] += sign * (double)plane[idx + x];
+            }
          }
       }
+   }
 
-   /* sort the groups by the count size */
-   if(verbose){
-      fprintf(stdout, "Found %d unique groups from %d, sorting...\n", num_groups,
-              group_idx);
+/* box local correlation of the z-slab [start, stop).  The sums are */
+/* run along x, then y, then z so each voxel costs the same however */
+/* large the box, the planes in the z window are kept in a ring     */
+static void lcorr_box_slab(void *arg, int start, int stop, int thread)
+{
+   lcorr_args_struct *args = (lcorr_args_struct *) arg;
+   int     *sizes = args->src->sizes;
+   int      x, y, z, depth;
+   long     slice, idx;
+   float   *ring, *xsum;
+   double  *acc, *row_acc;
+   double   denom, value;
+
+   slice = (long)sizes[1] * sizes[2];
+   depth = args->b1[0] - args->b0[0] + 1;
+   ALLOC(ring, depth * LCORR_SUMS * slice);
+   ALLOC(xsum, LCORR_SUMS * slice);
+   ALLOC(row_acc, LCORR_SUMS * sizes[2]);
+   ALLOC(acc, LCORR_SUMS * slice);
+   memset(acc, 0, LCORR_SUMS * slice * sizeof(double));
+
+   /* fill the window up to the last plane of the first output slice */
+   for(z = start + args->b0[0]; z < start + args->b1[0]; z++){
+      lcorr_plane(args, z, &ring[(z % depth) * LCORR_SUMS * slice], xsum, row_acc);
+      lcorr_accumulate(args, acc, &ring[(z % depth) * LCORR_SUMS * slice], 1);
       }
-   qsort(group_data, num_groups, sizeof(Group_info), &compare_groups);
 
-   /* set up the transpose array */
-   trans = (unsigned int *)malloc(sizeof(unsigned int) * group_idx);
-   for(c = 0; c < num_groups; c++){
-      trans[group_data[c]->orig_label] = c + 1; /* +1 to bump past 0 */
-      }
+   for(z = start; z < stop; z++){
+      idx = ((z + args->b1[0]) % depth) * LCORR_SUMS * slice;
+      lcorr_plane(args, z + args->b1[0], &ring[idx], xsum, row_acc);
+      lcorr_accumulate(args, acc, &ring[idx], 1);
 
-   /* pass 2 - resolve equivalences in the output data */
-   if(verbose){
-      fprintf(stdout, "Resolving equivalences...\n");
-      }
-   for(z = sizes[0]; z--;){
-      for(y = sizes[1]; y--;){
-         for(x = sizes[2]; x--;){
-            value = (unsigned int)get_volume_voxel_value(*vol, z, y, x, 0, 0);
-            if(value != 0){
-               value = trans[equiv[value]];
-               set_volume_voxel_value(*vol, z, y, x, 0, 0, (Real) value);
+      for(y = args->lo[1]; y < args->hi[1]; y++){
+         idx = (long)y * sizes[2];
+         for(x = args->lo[2]; x < args->hi[2]; x++){
+
+            /* no non-zero voxels, the rounding left in a running */
+            /* sum must not turn into a correlation               */
+            if(acc[3 * slice + idx + x] < 0.5 || acc[4 * slice + idx + x] < 0.5){
+               value = 0.0;
+               }
+            else {
+               denom = sqrt(acc[idx + x] * acc[slice + idx + x]);
+               value = (denom <= 0.0) ? 0.0 : acc[2 * slice + idx + x] / denom;
+               if(value > 1.0){
+                  value = 1.0;
+                  }
+               else if(value < -1.0){
+                  value = -1.0;
+                  }
                }
+            args->dst[args->target]->data[RAW_INDEX(args->src, z, y, x)] = value;
             }
          }
-      }
 
-   /* tidy up */
-   delete_volume(tmp_vol);
-   for(c = 0; c < num_groups; c++){
-      free(group_data[c]);
+      idx = ((z + args->b0[0]) % depth) * LCORR_SUMS * slice;
+      lcorr_accumulate(args, acc, &ring[idx], -1);
+
+      if(thread == 0){
+         update_progress_report(args->progress, args->target * sizes[0] + z + 1);
+         }
       }
-   free(group_data);
-   free(trans);
-   free(k1);
-   free(k2);
 
-   return (vol);
+   FREE(ring);
+   FREE(xsum);
+   FREE(row_acc);
+   FREE(acc);
    }
 
 /* do local correlation to another volume                    */
 /* xcorr = sum((a*b)^2) / (sqrt(sum(a^2)) * sqrt(sum(b^2))   */
-VIO_Volume *lcorr_kernel(Kernel * K, VIO_Volume * vol, VIO_Volume *cmp)
+Raw_volume *lcorr_kernel(Kernel * K, Raw_volume * vol, Raw_volume *cmp)
 {
-   int      x, y, z, c;
-   double   value, v1, v2;
-   double   ssum_v1, ssum_v2, sum_prd, denom;
-   int      sizes[MAX_VAR_DIMS];
+   Raw_volume *map;
+
+   return (lcorr_multi_kernel(K, vol, &cmp, &map, 1));
+   }
+
+/* local correlation to n volumes in one pass over vol, maps[k] is */
+/* set to the map for cmp[k].  maps[0] comes from the raw pool and  */
+/* is also returned, the rest are new volumes owned by the caller   */
+Raw_volume *lcorr_multi_kernel(Kernel * K, Raw_volume * vol, Raw_volume *cmp[],
+                               Raw_volume *maps[], int n)
+{
+   int      k;
+   lcorr_args_struct args;
    progress_struct progress;
-   Volume   tmp_vol;
    
    if(verbose){
       fprintf(stdout, "Local Correlation kernel\n");
       }
-   get_volume_sizes(*vol, sizes);
-   initialize_progress_report(&progress, FALSE, sizes[2], "Local Correlation");
 
-   /* copy the volume */
-   tmp_vol = copy_volume(*vol);
-   
-   /* zero the output volume */
-   for(z = sizes[0]; z--;){
-      for(y = sizes[1]; y--;){
-         for(x = sizes[2]; x--;){
-            set_volume_voxel_value(*vol, z, y, x, 0, 0, 0);
-            }
-         }
+   /* write into the spare volume and new ones */
+   args.K = K;
+   args.src = vol;
+   args.cmp = cmp;
+   args.dst = maps;
+   args.n_cmp = n;
+   args.progress = &progress;
+   for(k = 0; k < n; k++){
+      maps[k] = (k == 0) ? get_spare_raw_volume(vol) : new_raw_volume(vol->sizes);
+      
+      /* zero the output volume */
+      memset(maps[k]->data, 0, vol->nvox * sizeof(float));
+      }
+   for(k = 0; k < 3; k++){
+      args.lo[k] = -K->pre_pad[2 - k];
+      args.hi[k] = vol->sizes[k] - K->post_pad[2 - k];
       }
    
-   /* set output range */
-   set_volume_real_range(*vol, 0.0, 1.0);
-   
-   for(z = -K->pre_pad[2]; z < sizes[0] - K->post_pad[2]; z++){
-      for(y = -K->pre_pad[1]; y < sizes[1] - K->post_pad[1]; y++){
-         for(x = -K->pre_pad[0]; x < sizes[2] - K->post_pad[0]; x++){
-            
-            /* init counters */
-            ssum_v1 = ssum_v2 = sum_prd = 0;
-            for(c = 0; c < K->nelems; c++){
-               v1 = get_volume_real_value(tmp_vol,
-                                          z + K->K[c][2],
-                                          y + K->K[c][1],
-                                          x + K->K[c][0], 0 + K->K[c][3],
-                                          0 + K->K[c][4]) * K->K[c][5];
-               v2 = get_volume_real_value(*cmp,
-                                          z + K->K[c][2],
-                                          y + K->K[c][1],
-                                          x + K->K[c][0], 0 + K->K[c][3],
-                                          0 + K->K[c][4]) * K->K[c][5];
-               
-               /* increment counters */
-               ssum_v1 += v1*v1;
-               ssum_v2 += v2*v2;
-               sum_prd += v1*v2;
-               }
-            
-            denom = sqrt(ssum_v1 * ssum_v2);
-            value = (denom == 0.0) ? 0.0 : sum_prd / denom;
-            
-            set_volume_real_value(*vol, z, y, x, 0, 0, value);
-            }
+   /* boxes as running sums one map at a time, as the cost no longer */
+   /* depends on the kernel, anything else element by element        */
+   if(get_lcorr_box(K, args.b0, args.b1)){
+      if(verbose){
+         fprintf(stdout, "  box of %d x %d x %d, using running sums\n",
+                 args.b1[2] - args.b0[2] + 1, args.b1[1] - args.b0[1] + 1,
+                 args.b1[0] - args.b0[0] + 1);
+         }
+      initialize_progress_report(&progress, FALSE, n * vol->sizes[0], "Local Correlation");
+      for(args.target = 0; args.target < n; args.target++){
+         run_slabs(lcorr_box_slab, &args, args.lo[0], args.hi[0]);
          }
-      update_progress_report(&progress, z + 1);
+      }
+   else {
+      initialize_progress_report(&progress, FALSE, vol->sizes[0], "Local Correlation");
+      run_slabs(lcorr_slab, &args, args.lo[0], args.hi[0]);
       }
    terminate_progress_report(&progress);
    
    /* tidy up */
-   delete_volume(tmp_vol);
+   release_raw_volume(vol);
    
-   return (vol);
+   return (maps[0]);
    }
@@ -5,17 +5,63 @@
 
 #include <volume_io.h>
 #include "kernel_io.h"
+#include "raw_volume.h"
+#include "bit_volume.h"
+
+/* statistics of a group labelled by group_kernel, voxel positions are (z, y, x) */
+typedef struct {
+   unsigned int count;
+   double   sum;                       /* of the input values */
+   double   pos_sum[3];                /* of the voxel positions */
+   int      lo[3];                     /* bounding box (incl) */
+   int      hi[3];
+   } group_stats_struct;
+
+typedef group_stats_struct *Group_stats;
+
+/* operations that front_kernel can iterate */
+typedef enum {
+   FRONT_ERODE, FRONT_DILATE, FRONT_MDILATE
+   } front_types;
+
+/* voxel by voxel operations that point_kernel does in one pass */
+typedef enum {
+   POINT_BINARISE, POINT_CLAMP
+   } point_types;
+
+typedef struct {
+   point_types type;
+   double   range[2];                  /* floor and ceil */
+   double   fg;                        /* binarise: value inside the range */
+   double   bg;                        /* value outside the range */
+   } Point_op;
 
 /* kernel functions */
-VIO_Volume  *binarise(VIO_Volume * vol, double floor, double ceil, double fg, double bg);
-VIO_Volume  *clamp(VIO_Volume * vol, double floor, double ceil, double bg);
-VIO_Volume  *pad(Kernel * K, VIO_Volume * vol, double bg);
-VIO_Volume  *erosion_kernel(Kernel * K, VIO_Volume * vol);
-VIO_Volume  *dilation_kernel(Kernel * K, VIO_Volume * vol);
-VIO_Volume  *median_dilation_kernel(Kernel * K, VIO_Volume * vol);
-VIO_Volume  *convolve_kernel(Kernel * K, VIO_Volume * vol);
-VIO_Volume  *distance_kernel(Kernel * K, VIO_Volume * vol, double bg);
-VIO_Volume  *group_kernel(Kernel * K, VIO_Volume * vol, double bg);
-VIO_Volume  *lcorr_kernel(Kernel * K, VIO_Volume * vol, VIO_Volume *cmp);
+Raw_volume *point_kernel(Raw_volume * vol, Point_op ops[], int n, double *min, double *max);
+double   point_value(Point_op ops[], int n, double value);
+Raw_volume *binarise(Raw_volume * vol, double floor, double ceil, double fg, double bg);
+Raw_volume *clamp(Raw_volume * vol, double floor, double ceil, double bg);
+Raw_volume *pad(Kernel * K, Raw_volume * vol, double bg);
+Raw_volume *erosion_kernel(Kernel * K, Raw_volume * vol);
+Raw_volume *dilation_kernel(Kernel * K, Raw_volume * vol);
+Raw_volume *morph_sequence_kernel(Kernel * K, Raw_volume * vol, int is_max[], int n);
+Raw_volume *median_dilation_kernel(Kernel * K, Raw_volume * vol);
+Raw_volume *front_kernel(Kernel * K, Raw_volume * vol, front_types type, int n);
+Raw_volume *median_filter_kernel(Kernel * K, Raw_volume * vol);
+Raw_volume *rank_filter_kernel(Kernel * K, Raw_volume * vol, double p);
+Raw_volume *convolve_kernel(Kernel * K, Raw_volume * vol);
+Raw_volume *distance_kernel(Kernel * K, Raw_volume * vol, double bg);
+Raw_volume *euclidean_distance(Raw_volume * vol, double bg, double sep[]);
+Raw_volume *gaussian_blur(Raw_volume * vol, double sigma[]);
+Raw_volume *group_kernel(Kernel * K, Raw_volume * vol, double bg,
+                         unsigned int min_size, unsigned int max_groups,
+                         Group_stats * stats, int *n_stats);
+Raw_volume *lcorr_kernel(Kernel * K, Raw_volume * vol, Raw_volume *cmp);
+Raw_volume *lcorr_multi_kernel(Kernel * K, Raw_volume * vol, Raw_volume *cmp[],
+                               Raw_volume *maps[], int n);
+
+/* erosion and dilation of bit-packed binary volumes (flat kernels only) */
+Bit_volume *bit_erosion_kernel(Kernel * K, Bit_volume * vol, long *n_changed);
+Bit_volume *bit_dilation_kernel(Kernel * K, Bit_volume * vol, long *n_changed);
 
 #endif
@@ -19,6 +19,7 @@
 #include <unistd.h>
 #include <sys/param.h>
 #include <float.h>
+#include <limits.h>
 #include <string.h>
 
 #include <volume_io.h>
@@ -27,14 +28,30 @@
 #include <time_stamp.h>
 #include "kernel_io.h"
 #include "kernel_ops.h"
+#include "raw_volume.h"
+#include "bit_volume.h"
+#include "threads.h"
+#include "row_ops.h"
 
 #define INTERNAL_PREC NC_FLOAT         /* should be NC_FLOAT or NC_DOUBLE */
 #define DEF_DOUBLE -DBL_MAX
+#define REPEAT_CONVERGE -1            /* {*}: repeat until nothing changes */
+#define DTYPE_DEFAULT ((nc_type) -1)   /* no output type was asked for */
 
 /* function prototypes */
 char    *get_real_from_string(char *string, double *value);
 char    *get_string_from_string(char *string, char **value);
-void     calc_volume_range(VIO_Volume * vol, double *min, double *max);
+char    *get_repeat_from_string(char *string, int *repeat);
+int      get_filenames_from_string(char *string, char ***files);
+char    *get_map_filename(char *outfile, char *cmpfile);
+void     calc_volume_range(Raw_volume * vol, double *min, double *max);
+void     update_volume_range(Raw_volume * vol, int start, int n, double *min, double *max);
+void     set_output_range(VIO_Volume vol, double min, double max);
+void     output_raw_volume(char *outfile, Raw_volume * raw, VIO_Volume like, nc_type type,
+                           int sign, double min, double max, char *infile, char *history);
+int      morph_stages(int type, int *stages);
+nc_type  get_output_type(int integral, double *min, double *max, int *sign);
+void     write_group_stats(char *fn, VIO_Volume vol, Group_stats stats, int n);
 void     print_version_info(void);
 
 /* kernel names for pretty output */
@@ -45,7 +62,7 @@ typedef enum {
    UNDEF = 0,
    BINARISE, CLAMP, PAD, ERODE, DILATE, MDILATE,
    MFILTER, OPEN, CLOSE, LPASS, HPASS, CONVOLVE, 
-   DISTANCE, GROUP, READ_KERNEL, WRITE, LCORR
+   DISTANCE, GROUP, READ_KERNEL, WRITE, LCORR, EDT, GAUSSIAN
    } op_types;
 
 typedef struct {
@@ -53,43 +70,75 @@ typedef struct {
    char     op_c;
    char    *kernel_fn;
    kern_types kernel_id;
-   char    *cmpfile;
+   char   **cmpfile;                   /* I: volumes to compare to */
+   char   **mapfile;                   /* I: where the maps after the first go */
+   int      n_cmp;
    char    *outfile;
    double   range[2];
    double   foreground;
    double   background;
+   int      use_mm;
+   double   fwhm;                      /* S: full width at half maximum (mm) */
+   double   percentile;                /* N: rank to filter with (DEF_DOUBLE for median) */
+   unsigned int min_size;              /* G: smallest group kept */
+   unsigned int max_groups;            /* G: largest groups kept (0 for all) */
+   int      repeat;                    /* times to do it or REPEAT_CONVERGE */
+   int      integral;                  /* the result holds only whole numbers */
+   VIO_Volume *stream_vol;             /* -stream: output or compare volume */
+   double   stream_range[2];           /* -stream: range written so far */
    } Operation;
 
+/* prototypes of functions on operations */
+Operation *add_operation(Operation ** operation, int *num_ops);
+Kernel  *load_kernel(Operation * op, char *prog);
+int      stream_halo(Operation operation[], int num_ops, char *prog);
+int      crop_reach(Operation operation[], int num_ops, int reach[], char *prog);
+int      integral_result(Operation * op, int integral, Kernel * kernel);
+
 /* Argument variables */
 int      verbose = FALSE;
 int      clobber = FALSE;
+int      n_threads = 1;
+int      use_simd = TRUE;
+int      stream = FALSE;
+int      slab_size = 32;
 int      is_signed = FALSE;
-nc_type  dtype = NC_SHORT;
+nc_type  dtype = DTYPE_DEFAULT;
+int      dtype_set = FALSE;
 double   range[2] = { -DBL_MAX, DBL_MAX };
 double   foreground = 1.0;
 double   background = 0.0;
 kern_types kernel_id = K_NULL;
 char    *kernel_fn = NULL;
 char    *succ_txt = "B";
+char    *group_stats_fn = NULL;
 
-char     successive_help[] = "Successive operations (Maximum: 100) \
+char     successive_help[] = "Successive operations \
 \n\tB[floor:ceil:fg:bg] - binarise in the range, using foreground and background \
 \n\tK[floor:ceil:bg] - clamp betwen the specified range. Set other voxels to 'bg' (default: 0) \
 \n\tP[bg] - pad volume with respect to the current kernel using 'bg' (default: 0)\
 \n\tE - erosion \
 \n\tD - dilation \
 \n\tM - median dilation \
-\n\tN - median filter \
+\n\tN[p] - median filter, or the p-th percentile of the kernel (0: min, 100: max) \
 \n\tO - open \
 \n\tC - close \
 \n\tL - lowpass filter \
 \n\tH - highpass filter \
 \n\tX - convolve \
 \n\tF - distance transform (binary input only - not checked) \
-\n\tG - Label the groups in the volume in ascending order \
+\n\tT[mm] - exact Euclidean distance to the background, in voxels or in mm \
+\n\tS[fwhm] - Gaussian blur with a full width at half maximum of fwhm mm \
+\n\tG[min_size:max_groups] - Label the groups in the volume in ascending order, \
+\n\t   dropping those smaller than min_size and keeping only the largest max_groups \
+\n\t   (default: keep all) \
 \n\tR[TYPE|file.kern] - (2D04|2D08|3D06|3D26) or read in a kernel file \
 \n\tW[file.mnc] - write out current results \
-\n\tI[cmp.mnc] - local xcorr between current file and cmp.mnc \
+\n\tI[cmp.mnc,...] - local xcorr between current file and cmp.mnc, given more than \
+\n\t   one the first map carries on and the others are written to out_cmp.mnc \
+\n\t   (I[@file] reads the names from a file, one per line) \
+\n\tAn op followed by {n} is done n times (eg: D{30}), E{*} D{*} and M{*} are \
+\n\t   repeated until nothing changes. Repeats stop early once a pass changes nothing \
 \n\tDefault: ";
 
 /* Argument table */
@@ -102,6 +151,14 @@ ArgvInfo argTable[] = {
     "be verbose"},
    {"-clobber", ARGV_CONSTANT, (char *)TRUE, (char *)&clobber,
     "clobber existing files"},
+   {"-threads", ARGV_INT, (char *)1, (char *)&n_threads,
+    "<n> number of threads to split the z range over (Default: 1)"},
+   {"-nosimd", ARGV_CONSTANT, (char *)FALSE, (char *)&use_simd,
+    "use the scalar row kernels instead of SSE2/AVX2/AVX-512 ones"},
+   {"-stream", ARGV_CONSTANT, (char *)TRUE, (char *)&stream,
+    "stream the volume through the operations in z-slabs (local operations only)"},
+   {"-slab", ARGV_INT, (char *)1, (char *)&slab_size,
+    "<n> number of output slices per slab with -stream (Default: 32)"},
 
    {NULL, ARGV_HELP, NULL, NULL,
     "\nOutfile Options"},
@@ -110,7 +167,9 @@ ArgvInfo argTable[] = {
    {"-byte", ARGV_CONSTANT, (char *)NC_BYTE, (char *)&dtype,
     "Write out byte data."},
    {"-short", ARGV_CONSTANT, (char *)NC_SHORT, (char *)&dtype,
-    "Write out short integer data. (Default)"},
+    "Write out short integer data. (Default, except for whole number results \
+\n\tsuch as masks and labels, which default to the smallest integer type that \
+\n\tholds them exactly: unsigned byte, short or int)"},
    {"-int", ARGV_CONSTANT, (char *)NC_INT, (char *)&dtype,
     "Write out long integer data."},
    {"-float", ARGV_CONSTANT, (char *)NC_FLOAT, (char *)&dtype,
@@ -121,6 +180,8 @@ ArgvInfo argTable[] = {
     "Write signed integer data."},
    {"-unsigned", ARGV_CONSTANT, (char *)FALSE, (char *)&is_signed,
     "Write unsigned integer data."},
+   {"-group_stats", ARGV_STRING, (char *)1, (char *)&group_stats_fn,
+    "<file.csv|file.json> write the size, centroid, bounding box and mean of each group (G)"},
 
    {NULL, ARGV_HELP, NULL, NULL, "\nKernel Options"},
    {"-2D04", ARGV_CONSTANT, (char *)K_2D04, (char *)&kernel_id,
@@ -173,6 +234,8 @@ ArgvInfo argTable[] = {
     "convolve file with kernel"},
    {"-distance", ARGV_CONSTANT, (char *)"F", (char *)&succ_txt,
     "distance transform"},
+   {"-edt", ARGV_CONSTANT, (char *)"T", (char *)&succ_txt,
+    "exact Euclidean distance transform"},
    {"-group", ARGV_CONSTANT, (char *)"G", (char *)&succ_txt,
     "label groups in ascending order"},
 
@@ -192,16 +255,41 @@ int main(int argc, char *argv[])
    char    *outfile;
 
    VIO_Volume *volume;
+   VIO_Volume defvol;
    VIO_Volume *cmpvol;
+   Raw_volume *rvol;
+   Raw_volume *full;
+   Raw_volume **rcmp;
+   Raw_volume **maps;
+   Bit_volume *bvol = NULL;
+   const char *simd_name;
    Kernel  *kernel;
    int      num_ops;
-   Operation operation[100];
+   int      n_stages;
+   int     *stages;
+   int      n_points, range_known;
+   Point_op *points;
+   double   range_min, range_max;
+   int      slab, n_slabs, slab_n, halo;
+   int      z0, z1, r0, r1;
+   int      crop, cropped;
+   int      reach[3], b0[3], b1[3], c0[3], c1[3], t0[3], t1[3];
+   double   outside;
+   int      sizes[MAX_VAR_DIMS];
+   int      n, r, repeat;
+   long     n_changed;
+   Group_stats gstats;
+   VIO_Real seps[MAX_VAR_DIMS];
+   double   sep[3], sigma[3];
+   Operation *operation;
    Operation *op;
    char    *tmp_str;
    char     ext_txt[256];
    char     tmp_filename[MAXPATHLEN];
    double   tmp_double[4];
    double   min, max;
+   nc_type  type;
+   int      sign;
    char    *ptr;
 
    char    *axis_order[3] = { MIzspace, MIyspace, MIxspace };
@@ -218,6 +306,28 @@ int main(int argc, char *argv[])
    infile = argv[1];
    outfile = argv[2];
 
+   /* masks and labels are written as the smallest integer type that */
+   /* holds them unless a type is asked for                          */
+   dtype_set = (dtype != DTYPE_DEFAULT);
+   if(!dtype_set){
+      dtype = NC_SHORT;
+      }
+
+   if(n_threads < 1){
+      fprintf(stderr, "%s: -threads must be at least 1\n\n", argv[0]);
+      exit(EXIT_FAILURE);
+      }
+   if(slab_size < 1){
+      fprintf(stderr, "%s: -slab must be at least 1\n\n", argv[0]);
+      exit(EXIT_FAILURE);
+      }
+
+   /* choose the row kernels for this CPU */
+   simd_name = init_row_ops(use_simd);
+   if(verbose){
+      fprintf(stdout, "Using %s row kernels\n", simd_name);
+      }
+
    /* check for the infile */
    if(access(infile, F_OK) != 0){
       fprintf(stderr, "%s: Couldn't find %s\n\n", argv[0], infile);
@@ -230,6 +340,13 @@ int main(int argc, char *argv[])
       exit(EXIT_FAILURE);
       }
 
+   /* check for the group statistics file */
+   if(group_stats_fn != NULL && access(group_stats_fn, F_OK) == 0 && !clobber){
+      fprintf(stderr, "%s: %s exists! (use -clobber to overwrite)\n\n", argv[0],
+              group_stats_fn);
+      exit(EXIT_FAILURE);
+      }
+
    /* check kernel args */
    if(kernel_fn != NULL && kernel_id != K_NULL){
       fprintf(stderr, "%s: specify either a kernel file or a set kernel (not both)\n\n",
@@ -243,8 +360,9 @@ int main(int argc, char *argv[])
       }
 
    /* add the implicit read kernel operation */
+   operation = NULL;
    num_ops = 0;
-   op = &operation[num_ops++];
+   op = add_operation(&operation, &num_ops);
 
    op->type = READ_KERNEL;
    op->kernel_fn = kernel_fn;
@@ -260,7 +378,7 @@ int main(int argc, char *argv[])
 
       /* set up counters and extra text */
       strcpy(ext_txt, "");
-      op = &operation[num_ops++];
+      op = add_operation(&operation, &num_ops);
 
       /* get the operation type */
       op->op_c = ptr[0];
@@ -323,6 +441,17 @@ int main(int argc, char *argv[])
 
       case 'N':
          op->type = MFILTER;
+
+         /* get 1 possible value */
+         ptr = get_real_from_string(ptr, &op->percentile);
+         if(op->percentile != DEF_DOUBLE){
+            if(op->percentile < 0.0 || op->percentile > 100.0){
+               fprintf(stderr, "%s: N[p] needs a percentile from 0 to 100, not %g\n\n",
+                       argv[0], op->percentile);
+               exit(EXIT_FAILURE);
+               }
+            sprintf(ext_txt, "percentile: %g", op->percentile);
+            }
          break;
 
       case 'O':
@@ -351,6 +480,48 @@ int main(int argc, char *argv[])
 
       case 'G':
          op->type = GROUP;
+
+         /* get 2 possible values */
+         ptr = get_real_from_string(ptr, &tmp_double[0]);
+         ptr = get_real_from_string(ptr, &tmp_double[1]);
+         op->min_size = (tmp_double[0] == DEF_DOUBLE || tmp_double[0] < 0) ?
+            0 : (unsigned int)tmp_double[0];
+         op->max_groups = (tmp_double[1] == DEF_DOUBLE || tmp_double[1] < 0) ?
+            0 : (unsigned int)tmp_double[1];
+
+         sprintf(ext_txt, "min size: %u max groups: %u", op->min_size, op->max_groups);
+         break;
+
+      case 'T':
+         op->type = EDT;
+
+         /* distances are in voxels unless mm is given */
+         ptr = get_string_from_string(ptr, &tmp_str);
+         op->use_mm = FALSE;
+         if(tmp_str != NULL){
+            if(strcmp(tmp_str, "mm") != 0){
+               fprintf(stderr, "%s: T[mm] only takes mm, not %s\n\n", argv[0], tmp_str);
+               exit(EXIT_FAILURE);
+               }
+            op->use_mm = TRUE;
+            free(tmp_str);
+            }
+
+         sprintf(ext_txt, "units: %s", (op->use_mm) ? "mm" : "voxels");
+         break;
+
+      case 'S':
+         op->type = GAUSSIAN;
+
+         /* get 1 value */
+         ptr = get_real_from_string(ptr, &op->fwhm);
+         if(op->fwhm == DEF_DOUBLE || op->fwhm <= 0.0){
+            fprintf(stderr, "%s: S[fwhm] requires a FWHM (in mm) greater than 0\n\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+            }
+
+         sprintf(ext_txt, "fwhm: %gmm", op->fwhm);
          break;
 
       case 'R':
@@ -417,20 +588,47 @@ int main(int argc, char *argv[])
          op->type = LCORR;
 
          /* get the filenames */
-         ptr = get_string_from_string(ptr, &op->cmpfile);
+         ptr = get_string_from_string(ptr, &tmp_str);
+         op->n_cmp = (tmp_str == NULL) ? 0 : get_filenames_from_string(tmp_str, &op->cmpfile);
 
-         if(op->cmpfile == NULL){
+         if(op->n_cmp < 1){
             fprintf(stderr, "%s: I[cmp.mnc] requires a filename\n\n", argv[0]);
             exit(EXIT_FAILURE);
             }
-         
-         /* check for cmpfile */
-         if(access(op->cmpfile, F_OK) != 0){
-            fprintf(stderr, "%s: Couldn't find compare file: %s\n\n", argv[0], op->cmpfile);
+         if(op->n_cmp > 1 && stream){
+            fprintf(stderr, "%s: I with more than one compare file can't be used with -stream\n\n",
+                    argv[0]);
             exit(EXIT_FAILURE);
             }
+         free(tmp_str);
+         
+         /* check for the cmpfiles and the maps they will be written to */
+         ALLOC(op->mapfile, op->n_cmp);
+         op->mapfile[0] = NULL;
+         for(n = 0; n < op->n_cmp; n++){
+            if(access(op->cmpfile[n], F_OK) != 0){
+               fprintf(stderr, "%s: Couldn't find compare file: %s\n\n", argv[0],
+                       op->cmpfile[n]);
+               exit(EXIT_FAILURE);
+               }
+            if(n == 0){
+               continue;
+               }
+            op->mapfile[n] = get_map_filename(outfile, op->cmpfile[n]);
+            if(access(op->mapfile[n], F_OK) == 0 && !clobber){
+               fprintf(stderr, "%s: %s exists! (use -clobber to overwrite)\n\n", argv[0],
+                       op->mapfile[n]);
+               exit(EXIT_FAILURE);
+               }
+            }
 
-         sprintf(ext_txt, "compare filename: %s", op->cmpfile);
+         if(op->n_cmp == 1){
+            sprintf(ext_txt, "compare filename: %s", op->cmpfile[0]);
+            }
+         else {
+            sprintf(ext_txt, "compare filenames: %s and %d others", op->cmpfile[0],
+                    op->n_cmp - 1);
+            }
          break;
 
       default:
@@ -439,6 +637,30 @@ int main(int argc, char *argv[])
          exit(EXIT_FAILURE);
          }
 
+      /* get a possible repeat count */
+      ptr = get_repeat_from_string(ptr, &op->repeat);
+      if(op->repeat == 0){
+         fprintf(stderr, "%s: %c{n} needs a count of at least 1 or *\n\n", argv[0],
+                 op->op_c);
+         exit(EXIT_FAILURE);
+         }
+      if(op->repeat != 1 && (op->type == READ_KERNEL || op->type == WRITE)){
+         fprintf(stderr, "%s: %c can't be repeated\n\n", argv[0], op->op_c);
+         exit(EXIT_FAILURE);
+         }
+      if(op->repeat == REPEAT_CONVERGE &&
+         op->type != ERODE && op->type != DILATE && op->type != MDILATE){
+         fprintf(stderr, "%s: only E, D and M can be repeated until nothing changes\n\n",
+                 argv[0]);
+         exit(EXIT_FAILURE);
+         }
+      if(op->repeat == REPEAT_CONVERGE){
+         strcat(ext_txt, " (until nothing changes)");
+         }
+      else if(op->repeat > 1){
+         sprintf(&ext_txt[strlen(ext_txt)], " (x%d)", op->repeat);
+         }
+
       if(verbose){
          fprintf(stdout, "  Op[%02d] %c = %d\t\t%s\n", num_ops, op->op_c, op->type,
                  ext_txt);
@@ -447,9 +669,31 @@ int main(int argc, char *argv[])
 
    /* add an implicit write statment to the end if needed */
    if(operation[num_ops - 1].type != WRITE){
-      operation[num_ops].type = WRITE;
-      operation[num_ops].outfile = outfile;
-      num_ops++;
+      op = add_operation(&operation, &num_ops);
+      op->type = WRITE;
+      op->outfile = outfile;
+      }
+
+   /* follow which results are whole numbers through the operations */
+   /* and the kernel that is current at each of them                 */
+   kernel = NULL;
+   for(c = 0; c < num_ops; c++){
+      if(operation[c].type == READ_KERNEL){
+         if(kernel != NULL){
+            delete_kernel(kernel);
+            }
+         kernel = load_kernel(&operation[c], argv[0]);
+         }
+      operation[c].integral = integral_result(&operation[c],
+                                              (c > 0) ? operation[c - 1].integral : FALSE,
+                                              kernel);
+      }
+   delete_kernel(kernel);
+
+   /* when streaming volume_io caches the volumes rather than loading them */
+   if(stream){
+      set_n_bytes_cache_threshold(0);
+      set_cache_block_sizes_hint(SLICE_ACCESS);
       }
 
    /* malloc space for volume structure and read in infile */
@@ -458,187 +702,471 @@ int main(int argc, char *argv[])
                 INTERNAL_PREC, TRUE, 0.0, 0.0, TRUE, volume, NULL);
    get_type_range(get_volume_data_type(*volume), &min, &max);
    set_volume_real_range(*volume, min, max);
+   get_volume_sizes(*volume, sizes);
+
+   /* the output slabs and the input slices either side each one needs */
+   if(stream){
+      halo = stream_halo(operation, num_ops, argv[0]);
+      slab_n = slab_size;
+      }
+   else {
+      halo = 0;
+      slab_n = sizes[0];
+      }
+   crop = !stream && crop_reach(operation, num_ops, reach, argv[0]);
+   n_slabs = (sizes[0] + slab_n - 1) / slab_n;
 
    /* init and then do some operations */
    kernel = new_kernel(0);
-
-   if(verbose){
-      fprintf(stdout, "\n---Doing %d Operation(s)---\n", num_ops);
+   n_stages = 0;
+   for(c = 0; c < num_ops; c++){
+      if(operation[c].repeat > 0){
+         n_stages += morph_stages(operation[c].type, NULL) * operation[c].repeat;
+         }
       }
+   ALLOC(stages, n_stages + 1);
+   n_points = 0;
    for(c = 0; c < num_ops; c++){
-      op = &operation[c];
+      if(operation[c].type == BINARISE || operation[c].type == CLAMP){
+         n_points += operation[c].repeat;
+         }
+      }
+   ALLOC(points, n_points + 1);
+
+   for(slab = 0; slab < n_slabs; slab++){
+      z0 = slab * slab_n;
+      z1 = (z0 + slab_n < sizes[0]) ? z0 + slab_n : sizes[0];
+      r0 = (z0 - halo > 0) ? z0 - halo : 0;
+      r1 = (z1 + halo < sizes[0]) ? z1 + halo : sizes[0];
+
+      /* pull the slab into a contiguous buffer (and its spare) for the operations */
+      rvol = volume_slab_to_raw(*volume, r0, r1 - r0);
+
+      /* outside -stream the voxels now live in rvol, volume_io only */
+      /* keeps the definition of the volume for the writes           */
+      if(!stream){
+         defvol = copy_volume_definition_no_alloc(*volume, INTERNAL_PREC, TRUE, 0.0, 0.0);
+         delete_volume(*volume);
+         *volume = defvol;
+         }
 
-      switch (op->type){
-      case BINARISE:
-         volume = binarise(volume, op->range[0], op->range[1],
-                           op->foreground, op->background);
-         break;
+      if(verbose){
+         if(stream){
+            fprintf(stdout, "\n---Slab [%d:%d) from slices [%d:%d)---\n", z0, z1, r0, r1);
+            }
+         fprintf(stdout, "\n---Doing %d Operation(s)---\n", num_ops);
+         }
 
-      case CLAMP:
-         volume = clamp(volume, op->range[0], op->range[1], op->background);
-         break;
+      /* outside the reach of the foreground a chain of local ops leaves */
+      /* the background constant, so the ops are only run over the box   */
+      /* of the foreground plus twice their reach.  Within one reach of  */
+      /* the foreground this gives the same as the whole volume, beyond  */
+      /* that the result is the background carried through the ops      */
+      cropped = FALSE;
+      outside = background;
+      if(crop){
+         if(!raw_bounding_box(rvol, background, b0, b1)){
+            for(n = 0; n < 3; n++){
+               b0[n] = 0;
+               b1[n] = 1;
+               }
+            }
+         for(n = 0; n < 3; n++){
+            t0[n] = (b0[n] - reach[n] > 0) ? b0[n] - reach[n] : 0;
+            t1[n] = (b1[n] + reach[n] < rvol->sizes[n]) ? b1[n] + reach[n] : rvol->sizes[n];
+            c0[n] = (b0[n] - 2 * reach[n] > 0) ? b0[n] - 2 * reach[n] : 0;
+            c1[n] = (b1[n] + 2 * reach[n] < rvol->sizes[n]) ?
+               b1[n] + 2 * reach[n] : rvol->sizes[n];
+            }
 
-      case PAD:
-         volume = pad(kernel, volume, op->background);
-         break;
+         /* only worth the copies if most of the volume is skipped */
+         if((double)(c1[0] - c0[0]) * (c1[1] - c0[1]) * (c1[2] - c0[2]) < rvol->nvox / 2.0){
+            if(verbose){
+               fprintf(stdout, "Cropping to [%d:%d) [%d:%d) [%d:%d) around the foreground\n",
+                       c0[0], c1[0], c0[1], c1[1], c0[2], c1[2]);
+               }
+            full = rvol;
+            rvol = crop_raw_volume(full, c0, c1);
+            delete_raw_volume(full);
+            cropped = TRUE;
+            }
+         }
+      init_raw_pool(rvol);
+      range_known = FALSE;
+      for(c = 0; c < num_ops; c++){
+         op = &operation[c];
+
+         /* labels are written as they are, the other ops need floats */
+         if(rvol->type == RAW_LABEL && op->type != WRITE && op->type != READ_KERNEL){
+            rvol = labels_to_float(rvol);
+            }
 
-      case ERODE:
-         volume = erosion_kernel(kernel, volume);
-         break;
+         /* binary volumes are kept bit-packed over runs of flat erosions */
+         /* and dilations, anything else gets the float voxels back       */
+         if((op->type == ERODE || op->type == DILATE || op->type == OPEN ||
+             op->type == CLOSE || op->type == LPASS) && kernel->unit_coeffs){
+            if(bvol == NULL && (bvol = raw_to_bits(rvol)) != NULL){
+               if(verbose){
+                  fprintf(stdout, "Packing binary volume [%g:%g]\n", bvol->lo, bvol->hi);
+                  }
+               free(rvol->data);
+               rvol->data = NULL;
+               empty_raw_pool();
+               }
+            }
+         else if(op->type != READ_KERNEL && bvol != NULL){
+            bits_to_raw(bvol, rvol);
+            delete_bit_volume(bvol);
+            bvol = NULL;
+            }
 
-      case DILATE:
-         volume = dilation_kernel(kernel, volume);
-         break;
+         /* a run of point operations is done in one pass, which also */
+         /* finds the range of the result for a write that follows    */
+         if(op->type != WRITE && op->type != READ_KERNEL){
+            range_known = FALSE;
+            }
+         if(op->type == BINARISE || op->type == CLAMP){
+            n_points = 0;
+            while(c < num_ops &&
+                  (operation[c].type == BINARISE || operation[c].type == CLAMP)){
+               for(r = 0; r < operation[c].repeat; r++){
+                  points[n_points].type = (operation[c].type == BINARISE) ?
+                     POINT_BINARISE : POINT_CLAMP;
+                  points[n_points].range[0] = operation[c].range[0];
+                  points[n_points].range[1] = operation[c].range[1];
+                  points[n_points].fg = operation[c].foreground;
+                  points[n_points].bg = operation[c].background;
+                  n_points++;
+                  }
+               c++;
+               }
+            c--;
+            rvol = point_kernel(rvol, points, n_points, &range_min, &range_max);
+            range_known = TRUE;
+
+            /* the voxels cropped off get the same ops */
+            if(cropped){
+               outside = point_value(points, n_points, outside);
+               if(outside < range_min){
+                  range_min = outside;
+                  }
+               if(outside > range_max){
+                  range_max = outside;
+                  }
+               }
+            continue;
+            }
 
-      case MDILATE:
-         volume = median_dilation_kernel(kernel, volume);
-         break;
+         /* float erosions and dilations until nothing changes follow */
+         /* the active front, other runs are done as one sequence      */
+         if(bvol == NULL && op->repeat == REPEAT_CONVERGE &&
+            (op->type == ERODE || op->type == DILATE)){
+            rvol = front_kernel(kernel, rvol, (op->type == DILATE) ? FRONT_DILATE : FRONT_ERODE,
+                                -1);
+            continue;
+            }
+         if(bvol == NULL && morph_stages(op->type, NULL) > 0){
+            n_stages = 0;
+            while(c < num_ops && morph_stages(operation[c].type, NULL) > 0 &&
+                  operation[c].repeat != REPEAT_CONVERGE){
+               for(r = 0; r < operation[c].repeat; r++){
+                  n_stages += morph_stages(operation[c].type, &stages[n_stages]);
+                  }
+               c++;
+               }
+            c--;
+            rvol = morph_sequence_kernel(kernel, rvol, stages, n_stages);
+            continue;
+            }
 
-      case MFILTER:
-         volume = median_filter_kernel(kernel, volume);
-         break;
+         /* so is a run of median dilations */
+         if(op->type == MDILATE){
+            n = 0;
+            while(c < num_ops && operation[c].type == MDILATE){
+               n = (n < 0 || operation[c].repeat == REPEAT_CONVERGE) ? -1 :
+                  n + operation[c].repeat;
+               c++;
+               }
+            c--;
+            if(n == 1){
+               rvol = median_dilation_kernel(kernel, rvol);
+               }
+            else {
+               rvol = front_kernel(kernel, rvol, FRONT_MDILATE, n);
+               }
+            continue;
+            }
 
-      case OPEN:
-         volume = erosion_kernel(kernel, volume);
-         volume = dilation_kernel(kernel, volume);
-         break;
+         /* repeats of the other ops, binary erosions and dilations */
+         /* stop once a pass changes nothing                        */
+         repeat = (op->repeat == REPEAT_CONVERGE) ? INT_MAX : op->repeat;
+         for(r = 0; r < repeat; r++){
+            n_changed = -1;
 
-      case CLOSE:
-         volume = dilation_kernel(kernel, volume);
-         volume = erosion_kernel(kernel, volume);
-         break;
+            switch (op->type){
+            case PAD:
+               rvol = pad(kernel, rvol, op->background);
+               break;
 
-      case LPASS:
-         volume = erosion_kernel(kernel, volume);
-         volume = dilation_kernel(kernel, volume);
-         volume = dilation_kernel(kernel, volume);
-         volume = erosion_kernel(kernel, volume);
-         break;
+            case ERODE:
+               bvol = bit_erosion_kernel(kernel, bvol, &n_changed);
+               break;
 
-      case HPASS:
-         fprintf(stderr, "%s: GNFARK! Highpass Not implemented yet..\n\n", argv[0]);
-         break;
+            case DILATE:
+               bvol = bit_dilation_kernel(kernel, bvol, &n_changed);
+               break;
 
-      case CONVOLVE:
-         volume = convolve_kernel(kernel, volume);
-         break;
+            case MDILATE:
+               rvol = median_dilation_kernel(kernel, rvol);
+               break;
 
-      case DISTANCE:
-         volume = distance_kernel(kernel, volume, background);
-         break;
+            case MFILTER:
+               if(op->percentile == DEF_DOUBLE){
+                  rvol = median_filter_kernel(kernel, rvol);
+                  }
+               else {
+                  rvol = rank_filter_kernel(kernel, rvol, op->percentile);
+                  }
+               break;
 
-      case GROUP:
-         volume = group_kernel(kernel, volume, background);
-         break;
+            case OPEN:
+               bvol = bit_erosion_kernel(kernel, bvol, NULL);
+               bvol = bit_dilation_kernel(kernel, bvol, NULL);
+               break;
 
-      case READ_KERNEL:
-         /* free the existing kernel then set the pointer to the new one */
-         free(kernel);
+            case CLOSE:
+               bvol = bit_dilation_kernel(kernel, bvol, NULL);
+               bvol = bit_erosion_kernel(kernel, bvol, NULL);
+               break;
 
-         /* read in the kernel or set the kernel to an inbuilt one */
-         if(op->kernel_id == K_NULL){
-            kernel = new_kernel(0);
-            if(input_kernel(op->kernel_fn, kernel) != OK){
-               fprintf(stderr, "%s: Died reading in kernel file: %s\n\n", argv[0],
-                       op->kernel_fn);
-               exit(EXIT_FAILURE);
-               }
-            }
-         else {
+            case LPASS:
+               bvol = bit_erosion_kernel(kernel, bvol, NULL);
+               bvol = bit_dilation_kernel(kernel, bvol, NULL);
+               bvol = bit_dilation_kernel(kernel, bvol, NULL);
+               bvol = bit_erosion_kernel(kernel, bvol, NULL);
+               break;
 
-            switch (op->kernel_id){
-            case K_2D04:
-               kernel = get_2D04_kernel();
+            case HPASS:
+               fprintf(stderr, "%s: GNFARK! Highpass Not implemented yet..\n\n", argv[0]);
                break;
 
-            case K_2D08:
-               kernel = get_2D08_kernel();
+            case CONVOLVE:
+               rvol = convolve_kernel(kernel, rvol);
                break;
 
-            case K_3D06:
-               kernel = get_3D06_kernel();
+            case DISTANCE:
+               rvol = distance_kernel(kernel, rvol, background);
                break;
 
-            case K_3D26:
-               kernel = get_3D26_kernel();
+            case GROUP:
+               if(group_stats_fn == NULL){
+                  rvol = group_kernel(kernel, rvol, background, op->min_size, op->max_groups,
+                                      NULL, NULL);
+                  break;
+                  }
+
+               rvol = group_kernel(kernel, rvol, background, op->min_size, op->max_groups,
+                                   &gstats, &n);
+               write_group_stats(group_stats_fn, *volume, gstats, n);
+               FREE(gstats);
                break;
 
-            default:
-               fprintf(stderr, "%s: This shouldn't happen -- much bad\n\n", argv[0]);
-               exit(EXIT_FAILURE);
-               }
-            }
+            case EDT:
+               get_volume_separations(*volume, seps);
+               for(n = 0; n < 3; n++){
+                  sep[n] = (op->use_mm) ? fabs(seps[n]) : 1.0;
+                  }
+               rvol = euclidean_distance(rvol, background, sep);
+               break;
 
-         setup_pad_values(kernel);
-         if(verbose){
-            fprintf(stdout, "Input kernel:\n");
-            print_kernel(kernel);
-            }
-         break;
+            case GAUSSIAN:
+               get_volume_separations(*volume, seps);
+               for(n = 0; n < 3; n++){
+                  sigma[n] = op->fwhm / (2.0 * sqrt(2.0 * log(2.0))) / fabs(seps[n]);
+                  }
+               rvol = gaussian_blur(rvol, sigma);
+               break;
 
-      case WRITE:
-         if(op->outfile == NULL){
-            fprintf(stdout, "%s: WRITE passed a NULL pointer! - this is bad\n\n",
-                    argv[0]);
-            exit(EXIT_FAILURE);
-            }
+            case READ_KERNEL:
+               /* free the existing kernel then set the pointer to the new one */
+               delete_kernel(kernel);
+               kernel = load_kernel(op, argv[0]);
+               decompose_kernel(kernel);
+               compile_kernel(kernel, rvol->strides);
+               if(verbose){
+                  fprintf(stdout, "Input kernel:\n");
+                  print_kernel(kernel);
+                  }
+               break;
 
-         if(verbose){
-            fprintf(stdout, "Outputting to %s\n", op->outfile);
-            }
+            case WRITE:
+               if(op->outfile == NULL){
+                  fprintf(stdout, "%s: WRITE passed a NULL pointer! - this is bad\n\n",
+                          argv[0]);
+                  exit(EXIT_FAILURE);
+                  }
+
+               /* when streaming the output slices of this slab are handed to a */
+               /* cached volume that is written out once all slabs are done     */
+               if(stream){
+                  if(op->stream_vol == NULL){
+                     op->stream_vol = (VIO_Volume *) malloc(sizeof(VIO_Volume));
+                     *op->stream_vol = copy_volume_definition(*volume, INTERNAL_PREC, TRUE,
+                                                              0.0, 0.0);
+                     op->stream_range[0] = DBL_MAX;
+                     op->stream_range[1] = -DBL_MIN;
+                     }
+                  update_volume_range(rvol, z0 - r0, z1 - z0, &op->stream_range[0],
+                                      &op->stream_range[1]);
+                  raw_slab_to_volume(rvol, z0 - r0, z1 - z0, *op->stream_vol, z0);
+                  break;
+                  }
+
+               if(verbose){
+                  fprintf(stdout, "Outputting to %s\n", op->outfile);
+                  }
+
+               /* the spare is made again by the next op, this keeps */
+               /* it from sitting beside the volume being written    */
+               empty_raw_pool();
+
+               /* put a cropped result back in the whole volume */
+               full = rvol;
+               if(cropped){
+                  full = new_raw_volume(sizes);
+                  paste_raw_volume(rvol, c0, full, t0, t1, outside);
+                  }
+
+               /* get the resulting range, unless the point operations */
+               /* just before found it                                 */
+               if(range_known){
+                  min = range_min;
+                  max = (range_min == range_max) ? range_min + 1.0 : range_max;
+                  if(verbose){
+                     fprintf(stdout, "Range of [%g:%g] from the point operations\n", min, max);
+                     }
+                  }
+               else {
+                  calc_volume_range(full, &min, &max);
+                  }
+               type = get_output_type(op->integral, &min, &max, &sign);
+               output_raw_volume(op->outfile, full, *volume, type, sign, min, max,
+                                 infile, arg_string);
+               if(cropped){
+                  delete_raw_volume(full);
+                  }
+               break;
+
+            case LCORR:
+               if(op->cmpfile == NULL){
+                  fprintf(stdout, "%s: LCORR passed a NULL pointer! - this is bad\n\n",
+                          argv[0]);
+                  exit(EXIT_FAILURE);
+                  }
+
+               ALLOC(rcmp, op->n_cmp);
+               ALLOC(maps, op->n_cmp);
+               for(n = 0; n < op->n_cmp; n++){
+                  if(verbose){
+                     fprintf(stdout, "Comparing to %s\n", op->cmpfile[n]);
+                     }
+         
+                  /* when streaming the (cached) cmpfile is kept open over the slabs */
+                  if(stream){
+                     if(op->stream_vol == NULL){
+                        op->stream_vol = (VIO_Volume *) malloc(sizeof(VIO_Volume));
+                        input_volume(op->cmpfile[n], MAX_VAR_DIMS, axis_order,
+                           INTERNAL_PREC, TRUE, 0.0, 0.0, TRUE, op->stream_vol, NULL);
+                        }
+                     rcmp[n] = volume_slab_to_raw(*op->stream_vol, r0, r1 - r0);
+                     }
+
+                  /* malloc space for volume structure and read cmpfile */
+                  else {
+                     cmpvol = (VIO_Volume *) malloc(sizeof(VIO_Volume));
+                     input_volume(op->cmpfile[n], MAX_VAR_DIMS, axis_order,
+                        INTERNAL_PREC, TRUE, 0.0, 0.0, TRUE, cmpvol, NULL);
+                     rcmp[n] = volume_to_raw(*cmpvol);
+                     delete_volume(*cmpvol);
+                     free(cmpvol);
+                     }
+                  }
+         
+               /* run the local correlations in one pass over the volume */
+               rvol = lcorr_multi_kernel(kernel, rvol, rcmp, maps, op->n_cmp);
+         
+               /* the first map carries on, the others are written out */
+               for(n = 1; n < op->n_cmp; n++){
+                  if(verbose){
+                     fprintf(stdout, "Outputting to %s\n", op->mapfile[n]);
+                     }
+                  calc_volume_range(maps[n], &min, &max);
+                  output_raw_volume(op->mapfile[n], maps[n], *volume, dtype, is_signed,
+                                    min, max, infile, arg_string);
+                  delete_raw_volume(maps[n]);
+                  }
+
+               /* clean up */
+               for(n = 0; n < op->n_cmp; n++){
+                  delete_raw_volume(rcmp[n]);
+                  }
+               FREE(rcmp);
+               FREE(maps);
+         
+               break;
 
-         /* get the resulting range */
-         calc_volume_range(volume, &min, &max);
+            default:
+               fprintf(stderr, "\n%s: Unknown operation (This is very bad, call Houston)\n\n", argv[0]);
+               exit(EXIT_FAILURE);
+               }
 
-         /* set the range to something sensible (if possible) */
-         if(dtype == NC_BYTE && is_signed == FALSE){
-            if(min >= 0 && max < 255){
-               fprintf(stdout, "BYTE data, setting 1:1 mapping (0-256)\n");
-               min = 0;
-               max = 255;
+            /* a pass that changed nothing changes nothing when repeated */
+            if(n_changed == 0){
+               if(verbose && r + 1 < repeat){
+                  fprintf(stdout, "No change, skipping the remaining passes\n");
+                  }
+               break;
                }
             }
-         set_volume_real_range(*volume, min, max);
+         }
 
-         output_modified_volume(op->outfile,
-                                dtype, is_signed,
-                                0.0, 0.0, *volume, infile, arg_string, NULL);
-         break;
+      delete_raw_volume(rvol);
+      empty_raw_pool();
+      }
 
-      case LCORR:
-         if(op->cmpfile == NULL){
-            fprintf(stdout, "%s: LCORR passed a NULL pointer! - this is bad\n\n",
-                    argv[0]);
-            exit(EXIT_FAILURE);
-            }
+   /* write out the volumes the streamed output slices were handed to */
+   for(c = 0; c < num_ops; c++){
+      op = &operation[c];
+      if(op->stream_vol == NULL){
+         continue;
+         }
 
+      if(op->type == WRITE){
          if(verbose){
-            fprintf(stdout, "Comparing to %s\n", op->cmpfile);
+            fprintf(stdout, "Outputting to %s\n", op->outfile);
             }
-         
-         /* malloc space for volume structure and read cmpfile */
-         cmpvol = (VIO_Volume *) malloc(sizeof(VIO_Volume));
-         input_volume(op->cmpfile, MAX_VAR_DIMS, axis_order,
-            INTERNAL_PREC, TRUE, 0.0, 0.0, TRUE, cmpvol, NULL);
-         
-         /* run the local correlation */
-         volume = lcorr_kernel(kernel, volume, cmpvol);
-         
-         /* clean up */
-         delete_volume(*cmpvol);
-         free(cmpvol);
-         
-         break;
 
-      default:
-         fprintf(stderr, "\n%s: Unknown operation (This is very bad, call Houston)\n\n", argv[0]);
-         exit(EXIT_FAILURE);
+         min = op->stream_range[0];
+         max = op->stream_range[1];
+         if(min == max){
+            max = min + 1.0;
+            }
+         type = get_output_type(op->integral, &min, &max, &sign);
+         set_output_range(*op->stream_vol, min, max);
+         output_modified_volume(op->outfile,
+                                type, sign,
+                                0.0, 0.0, *op->stream_vol, infile, arg_string, NULL);
          }
+      delete_volume(*op->stream_vol);
+      free(op->stream_vol);
       }
 
    /* jump through operations freeing stuff */
    // free(op.kernel);
 
+   FREE(stages);
+   FREE(points);
+   FREE(operation);
    delete_volume(*volume);
    return (EXIT_SUCCESS);
    }
@@ -711,44 +1239,543 @@ char    *get_string_from_string(char *string, char **value)
    return string;
    }
 
-void calc_volume_range(VIO_Volume * vol, double *min, double *max)
+/* split a comma separated list of filenames, or read them one per  */
+/* line from a file given as @file, returns how many were found     */
+int get_filenames_from_string(char *string, char ***files)
+{
+   int      n;
+   char    *name;
+   char     line[MAXPATHLEN];
+   FILE    *fp;
+
+   n = 0;
+   *files = NULL;
+   if(string[0] == '@'){
+      if((fp = fopen(&string[1], "r")) == NULL){
+         fprintf(stderr, "Couldn't open the list of files: %s\n", &string[1]);
+         exit(EXIT_FAILURE);
+         }
+      while(fgets(line, MAXPATHLEN, fp) != NULL){
+         line[strcspn(line, "\r\n")] = '\0';
+         if(line[0] == '\0'){
+            continue;
+            }
+         SET_ARRAY_SIZE(*files, n, n + 1, DEFAULT_CHUNK_SIZE);
+         (*files)[n++] = strdup(line);
+         }
+      fclose(fp);
+      return n;
+      }
+
+   for(name = strtok(string, ","); name != NULL; name = strtok(NULL, ",")){
+      SET_ARRAY_SIZE(*files, n, n + 1, DEFAULT_CHUNK_SIZE);
+      (*files)[n++] = strdup(name);
+      }
+   return n;
+   }
+
+/* the file a local correlation map to cmpfile is written to, the */
+/* output filename with the compare file's name added (out_cmp.mnc) */
+char    *get_map_filename(char *outfile, char *cmpfile)
 {
+   char    *fn, *base, *ext;
+   int      stem, cmp_stem;
 
-   int      x, y, z;
-   int      sizes[MAX_VAR_DIMS];
-   double   value;
-   VIO_progress_struct progress;
+   base = strrchr(cmpfile, '/');
+   base = (base == NULL) ? cmpfile : base + 1;
+   ext = strstr(base, ".mnc");
+   cmp_stem = (ext == NULL) ? strlen(base) : ext - base;
+
+   ext = strstr(outfile, ".mnc");
+   stem = (ext == NULL) ? strlen(outfile) : ext - outfile;
 
+   fn = (char *)malloc(stem + cmp_stem + 6);
+   sprintf(fn, "%.*s_%.*s.mnc", stem, outfile, cmp_stem, base);
+   return fn;
+   }
+
+/* get a repeat count of the form {n}, or {*} for REPEAT_CONVERGE  */
+/* from a char* stream.  repeat is 1 if there is none and 0 if it  */
+/* is not understood.  Return the string advanced past it          */
+char    *get_repeat_from_string(char *string, int *repeat)
+{
+   char    *ptr;
+
+   *repeat = 1;
+   if(string[0] != '{'){
+      return string;
+      }
+   string++;
+
+   if(string[0] == '*'){
+      *repeat = REPEAT_CONVERGE;
+      ptr = string + 1;
+      }
+   else {
+      *repeat = (int)strtol(string, &ptr, 10);
+      if(ptr == string || *repeat < 1){
+         *repeat = 0;
+         }
+      }
+
+   /* skip over the '}' */
+   if(ptr[0] != '}'){
+      *repeat = 0;
+      return ptr;
+      }
+   return ptr + 1;
+   }
+
+void calc_volume_range(Raw_volume * vol, double *min, double *max)
+{
    *min = DBL_MAX;
    *max = -DBL_MIN;
+   update_volume_range(vol, 0, vol->sizes[0], min, max);
 
-   get_volume_sizes(*vol, sizes);
+   if (*min == *max) {
+       *max = *min + 1.0;
+   }
 
-   initialize_progress_report(&progress, FALSE, sizes[2], "Finding Range");
-   for(z = sizes[0]; z--;){
-      for(y = sizes[1]; y--;){
-         for(x = sizes[2]; x--;){
+   if(verbose){
+      fprintf(stdout, "Found range of [%g:%g]\n", *min, *max);
+      }
+   }
 
-            value = get_volume_voxel_value(*vol, z, y, x, 0, 0);
-            if(value < *min){
-               *min = value;
-               }
-            else if(value > *max){
-               *max = value;
-               }
+/* widen min and max to the values in the slices [start, start + n) */
+void update_volume_range(Raw_volume * vol, int start, int n, double *min, double *max)
+{
+
+   int      z;
+   long     i, idx;
+   double   value;
+   VIO_progress_struct progress;
+
+   initialize_progress_report(&progress, FALSE, n, "Finding Range");
+   for(z = start + n; z-- > start;){
+      for(i = vol->strides[0]; i--;){
+
+         idx = z * vol->strides[0] + i;
+         value = (vol->type == RAW_LABEL) ? vol->labels[idx] : vol->data[idx];
+         if(value < *min){
+            *min = value;
+            }
+         else if(value > *max){
+            *max = value;
             }
          }
-      update_progress_report(&progress, z + 1);
+      update_progress_report(&progress, z - start + 1);
       }
    terminate_progress_report(&progress);
+   }
 
-   if (*min == *max) {
-       *max = *min + 1.0;
+/* the type a result is written as, with no type asked for whole */
+/* numbers go in the smallest integer type that holds their range */
+/* and min and max are set to the range of that type so the       */
+/* voxels map 1:1 to the values                                    */
+nc_type get_output_type(int integral, double *min, double *max, int *sign)
+{
+   nc_type  type;
+
+   *sign = is_signed;
+   if(dtype_set || !integral){
+      return dtype;
+      }
+
+   if(*min >= 0.0 && *max <= 255.0){
+      type = NC_BYTE;
+      *sign = FALSE;
+      *min = 0.0;
+      *max = 255.0;
+      }
+   else if(*min >= 0.0 && *max <= 65535.0){
+      type = NC_SHORT;
+      *sign = FALSE;
+      *min = 0.0;
+      *max = 65535.0;
+      }
+   else if(*min >= -32768.0 && *max <= 32767.0){
+      type = NC_SHORT;
+      *sign = TRUE;
+      *min = -32768.0;
+      *max = 32767.0;
+      }
+   else if(*min >= -2147483648.0 && *max <= 2147483647.0){
+      type = NC_INT;
+      *sign = TRUE;
+      *min = -2147483648.0;
+      *max = 2147483647.0;
+      }
+   else {
+      return dtype;
+      }
+
+   if(verbose){
+      fprintf(stdout, "Whole numbers, writing %s %s\n", (*sign) ? "signed" : "unsigned",
+              (type == NC_BYTE) ? "bytes" : (type == NC_SHORT) ? "shorts" : "ints");
+      }
+   return type;
+   }
+
+/* set the real range of a volume for output, byte data is */
+/* given a 1:1 mapping if the range allows it               */
+void set_output_range(VIO_Volume vol, double min, double max)
+{
+   if(dtype == NC_BYTE && is_signed == FALSE){
+      if(min >= 0 && max < 255){
+         fprintf(stdout, "BYTE data, setting 1:1 mapping (0-256)\n");
+         min = 0;
+         max = 255;
+         }
+      }
+   set_volume_real_range(vol, min, max);
+   }
+
+/* write a Raw_volume out through a new volume_io volume with the */
+/* definition of like, the voxels are only held until written     */
+void output_raw_volume(char *outfile, Raw_volume * raw, VIO_Volume like, nc_type type,
+                       int sign, double min, double max, char *infile, char *history)
+{
+   VIO_Volume vol;
+
+   /* labels go through doubles so they stay exact */
+   vol = copy_volume_definition(like, (raw->type == RAW_LABEL) ? NC_DOUBLE : INTERNAL_PREC,
+                                TRUE, 0.0, 0.0);
+   set_output_range(vol, min, max);
+   raw_to_volume(raw, vol);
+   output_modified_volume(outfile, type, sign, 0.0, 0.0, vol, infile, history, NULL);
+   delete_volume(vol);
+   }
+
+/* add an operation (done once and otherwise empty) to the end of */
+/* the list, growing it as needed                                 */
+Operation *add_operation(Operation ** operation, int *num_ops)
+{
+   Operation *op;
+
+   SET_ARRAY_SIZE(*operation, *num_ops, *num_ops + 1, DEFAULT_CHUNK_SIZE);
+   op = &(*operation)[(*num_ops)++];
+   memset(op, 0, sizeof(Operation));
+   op->repeat = 1;
+   return op;
+   }
+
+/* read in the kernel of a READ_KERNEL operation or set it to an inbuilt one */
+Kernel  *load_kernel(Operation * op, char *prog)
+{
+   Kernel  *kernel;
+
+   if(op->kernel_id == K_NULL){
+      kernel = new_kernel(0);
+      if(input_kernel(op->kernel_fn, kernel) != OK){
+         fprintf(stderr, "%s: Died reading in kernel file: %s\n\n", prog, op->kernel_fn);
+         exit(EXIT_FAILURE);
+         }
+      }
+   else {
+
+      switch (op->kernel_id){
+      case K_2D04:
+         kernel = get_2D04_kernel();
+         break;
+
+      case K_2D08:
+         kernel = get_2D08_kernel();
+         break;
+
+      case K_3D06:
+         kernel = get_3D06_kernel();
+         break;
+
+      case K_3D26:
+         kernel = get_3D26_kernel();
+         break;
+
+      default:
+         fprintf(stderr, "%s: This shouldn't happen -- much bad\n\n", prog);
+         exit(EXIT_FAILURE);
+         }
+      }
+
+   setup_pad_values(kernel);
+   return kernel;
+   }
+
+/* the number of slices either side of an output slab that -stream  */
+/* has to read for the results in the slab to be the same as for    */
+/* the whole volume.  Each op can only get the z extent of its      */
+/* kernel wrong next to the edge of a slab, so this is the sum of   */
+/* the extents of the kernels used by the ops                       */
+int stream_halo(Operation operation[], int num_ops, char *prog)
+{
+   int      c, extent, halo;
+   Kernel  *kernel;
+
+   extent = halo = 0;
+   for(c = 0; c < num_ops; c++){
+      if(operation[c].repeat == REPEAT_CONVERGE){
+         fprintf(stderr, "%s: %c{*} has no bound on its reach, it can't be used with -stream\n\n",
+                 prog, operation[c].op_c);
+         exit(EXIT_FAILURE);
+         }
+
+      switch (operation[c].type){
+      case READ_KERNEL:
+         kernel = load_kernel(&operation[c], prog);
+         extent = kernel->post_pad[2] - kernel->pre_pad[2];
+         delete_kernel(kernel);
+         break;
+
+      case ERODE:
+      case DILATE:
+      case OPEN:
+      case CLOSE:
+      case LPASS:
+         halo += morph_stages(operation[c].type, NULL) * extent * operation[c].repeat;
+         break;
+
+      case PAD:
+      case MDILATE:
+      case MFILTER:
+      case CONVOLVE:
+      case LCORR:
+         halo += extent * operation[c].repeat;
+         break;
+
+      case DISTANCE:
+      case GROUP:
+      case EDT:
+      case GAUSSIAN:
+         fprintf(stderr, "%s: %c needs the whole volume, it can't be used with -stream\n\n",
+                 prog, operation[c].op_c);
+         exit(EXIT_FAILURE);
+
+      default:
+         break;
+         }
+      }
+
+   return halo;
    }
 
+/* the reach (z, y, x) of a chain of operations that can be cropped */
+/* to the foreground, FALSE if an op needs the whole volume or does */
+/* not map a constant background to a constant                       */
+int crop_reach(Operation operation[], int num_ops, int reach[], char *prog)
+{
+   int      c, n;
+   int      extent[3];
+   Kernel  *kernel;
+
+   for(n = 0; n < 3; n++){
+      extent[n] = reach[n] = 0;
+      }
+   for(c = 0; c < num_ops; c++){
+      if(operation[c].repeat == REPEAT_CONVERGE){
+         return FALSE;
+         }
+
+      switch (operation[c].type){
+      case READ_KERNEL:
+         kernel = load_kernel(&operation[c], prog);
+         for(n = 0; n < 3; n++){
+            extent[n] = kernel->post_pad[2 - n] - kernel->pre_pad[2 - n];
+            }
+         delete_kernel(kernel);
+         break;
+
+      case ERODE:
+      case DILATE:
+      case OPEN:
+      case CLOSE:
+      case LPASS:
+         for(n = 0; n < 3; n++){
+            reach[n] += morph_stages(operation[c].type, NULL) * extent[n] *
+               operation[c].repeat;
+            }
+         break;
+
+      case MDILATE:
+      case MFILTER:
+         for(n = 0; n < 3; n++){
+            reach[n] += extent[n] * operation[c].repeat;
+            }
+         break;
+
+      case BINARISE:
+      case CLAMP:
+      case WRITE:
+         break;
+
+      /* PAD and CONVOLVE treat the edges differently to the rest */
+      default:
+         return FALSE;
+         }
+      }
+
+   return TRUE;
+   }
+
+/* whether the result of an operation holds only whole numbers, */
+/* given whether its input did and the current kernel.  Erosions  */
+/* and dilations only pick out values that were there when the    */
+/* kernel has unit coefficients, the median filter does when its   */
+/* kernel has an odd number of elements (else the middle two are   */
+/* averaged) and a percentile always does                          */
+int integral_result(Operation * op, int integral, Kernel * kernel)
+{
+   int      c, unit_coeffs;
+
+   unit_coeffs = TRUE;
+   for(c = 0; c < kernel->nelems; c++){
+      if(kernel->K[c][5] != 1.0){
+         unit_coeffs = FALSE;
+         }
+      }
+
+   switch (op->type){
+   case BINARISE:
+      return (op->foreground == floor(op->foreground) &&
+              op->background == floor(op->background));
+
+   case CLAMP:
+   case PAD:
+      return (integral && op->background == floor(op->background));
+
+   case ERODE:
+   case DILATE:
+   case OPEN:
+   case CLOSE:
+   case LPASS:
+      return (integral && unit_coeffs);
+
+   case MFILTER:
+      return (integral && (op->percentile != DEF_DOUBLE || kernel->nelems % 2 == 1));
+
+   case MDILATE:
+   case READ_KERNEL:
+   case WRITE:
+      return integral;
+
+   case GROUP:
+      return TRUE;
+
+   default:
+      return FALSE;
+      }
+   }
+
+/* the erosion (FALSE) and dilation (TRUE) steps of a morphology */
+/* operation, returns how many there are (0 for other operations) */
+int morph_stages(int type, int *stages)
+{
+   static int erode_steps[] = { FALSE };
+   static int dilate_steps[] = { TRUE };
+   static int open_steps[] = { FALSE, TRUE };
+   static int close_steps[] = { TRUE, FALSE };
+   static int lpass_steps[] = { FALSE, TRUE, TRUE, FALSE };
+   int     *steps;
+   int      c, n;
+
+   switch (type){
+   case ERODE:
+      steps = erode_steps;
+      n = 1;
+      break;
+
+   case DILATE:
+      steps = dilate_steps;
+      n = 1;
+      break;
+
+   case OPEN:
+      steps = open_steps;
+      n = 2;
+      break;
+
+   case CLOSE:
+      steps = close_steps;
+      n = 2;
+      break;
+
+   case LPASS:
+      steps = lpass_steps;
+      n = 4;
+      break;
+
+   default:
+      return 0;
+      }
+
+   if(stages != NULL){
+      for(c = 0; c < n; c++){
+         stages[c] = steps[c];
+         }
+      }
+   return n;
+   }
+
+/* write the statistics of the groups to a file, as JSON if the name */
+/* ends in .json otherwise as CSV.  The centroid is in world          */
+/* co-ordinates and the bounding box in voxels, both as (x, y, z)     */
+void write_group_stats(char *fn, VIO_Volume vol, Group_stats stats, int n)
+{
+   FILE    *fp;
+   int      c, is_json;
+   double   voxel_vol, mean;
+   VIO_Real seps[MAX_VAR_DIMS];
+   VIO_Real world[3];
+
    if(verbose){
-      fprintf(stdout, "Found range of [%g:%g]\n", *min, *max);
+      fprintf(stdout, "Writing statistics of %d groups to %s\n", n, fn);
+      }
+
+   fp = fopen(fn, "w");
+   if(fp == NULL){
+      fprintf(stderr, "write_group_stats(): couldn't open %s for writing\n", fn);
+      exit(EXIT_FAILURE);
+      }
+   is_json = (strlen(fn) >= 5 && strcmp(fn + strlen(fn) - 5, ".json") == 0);
+
+   get_volume_separations(vol, seps);
+   voxel_vol = fabs(seps[0] * seps[1] * seps[2]);
+
+   if(is_json){
+      fprintf(fp, "[\n");
+      }
+   else {
+      fprintf(fp, "label,voxels,volume_mm3,mean,centroid_x,centroid_y,centroid_z,"
+              "bbox_min_x,bbox_min_y,bbox_min_z,bbox_max_x,bbox_max_y,bbox_max_z\n");
+      }
+
+   for(c = 0; c < n; c++){
+      mean = (stats[c].count > 0) ? stats[c].sum / stats[c].count : 0.0;
+      convert_3D_voxel_to_world(vol, stats[c].pos_sum[0] / stats[c].count,
+                                stats[c].pos_sum[1] / stats[c].count,
+                                stats[c].pos_sum[2] / stats[c].count,
+                                &world[0], &world[1], &world[2]);
+      if(is_json){
+         fprintf(fp, "  {\"label\": %d, \"voxels\": %u, \"volume_mm3\": %.10g, "
+                 "\"mean\": %.10g, \"centroid\": [%.10g, %.10g, %.10g], "
+                 "\"bbox_min\": [%d, %d, %d], \"bbox_max\": [%d, %d, %d]}%s\n",
+                 c + 1, stats[c].count, stats[c].count * voxel_vol, mean,
+                 world[0], world[1], world[2],
+                 stats[c].lo[2], stats[c].lo[1], stats[c].lo[0],
+                 stats[c].hi[2], stats[c].hi[1], stats[c].hi[0],
+                 (c < n - 1) ? "," : "");
+         }
+      else {
+         fprintf(fp, "%d,%u,%.10g,%.10g,%.10g,%.10g,%.10g,%d,%d,%d,%d,%d,%d\n",
+                 c + 1, stats[c].count, stats[c].count * voxel_vol, mean,
+                 world[0], world[1], world[2],
+                 stats[c].lo[2], stats[c].lo[1], stats[c].lo[0],
+                 stats[c].hi[2], stats[c].hi[1], stats[c].hi[0]);
+         }
+      }
+
+   if(is_json){
+      fprintf(fp, "]\n");
       }
+   fclose(fp);
    }
 
 void print_version_info(void)
@@ -0,0 +1,324 @@
+/* raw_volume.c - contiguous voxel buffers for the kernel operations */
+
+#include <string.h>
+#include <float.h>
+#include <volume_io.h>
+#include "raw_volume.h"
+
+/* returns a new (uninitialised) Raw_volume of the given z, y, x sizes */
+Raw_volume *new_raw_volume(int sizes[])
+{
+   Raw_volume *raw;
+
+   raw = (Raw_volume *) malloc(sizeof(Raw_volume));
+
+   raw->sizes[0] = sizes[0];
+   raw->sizes[1] = sizes[1];
+   raw->sizes[2] = sizes[2];
+
+   raw->strides[2] = 1;
+   raw->strides[1] = (long)sizes[2];
+   raw->strides[0] = (long)sizes[1] * sizes[2];
+   raw->nvox = (long)sizes[0] * raw->strides[0];
+
+   raw->type = RAW_FLOAT;
+   raw->labels = NULL;
+   raw->data = (float *)malloc(raw->nvox * sizeof(float));
+   if(raw->data == NULL){
+      print_error("new_raw_volume(): could not allocate %ld voxels\n", raw->nvox);
+      exit(EXIT_FAILURE);
+      }
+
+   return raw;
+   }
+
+/* returns a new label volume of the given z, y, x sizes, all 0 */
+Raw_volume *new_label_volume(int sizes[])
+{
+   Raw_volume *raw;
+
+   raw = (Raw_volume *) malloc(sizeof(Raw_volume));
+
+   raw->sizes[0] = sizes[0];
+   raw->sizes[1] = sizes[1];
+   raw->sizes[2] = sizes[2];
+
+   raw->strides[2] = 1;
+   raw->strides[1] = (long)sizes[2];
+   raw->strides[0] = (long)sizes[1] * sizes[2];
+   raw->nvox = (long)sizes[0] * raw->strides[0];
+
+   raw->type = RAW_LABEL;
+   raw->data = NULL;
+   raw->labels = (unsigned int *)calloc(raw->nvox, sizeof(unsigned int));
+   if(raw->labels == NULL){
+      print_error("new_label_volume(): could not allocate %ld labels\n", raw->nvox);
+      exit(EXIT_FAILURE);
+      }
+
+   return raw;
+   }
+
+/* hand back a label volume as floats (a float volume as it is), */
+/* labels above 2^24 are not exact                               */
+Raw_volume *labels_to_float(Raw_volume * raw)
+{
+   Raw_volume *fvol;
+   unsigned int max;
+   long     i;
+
+   if(raw->type != RAW_LABEL){
+      return raw;
+      }
+
+   fvol = get_spare_raw_volume(raw);
+   max = 0;
+   for(i = 0; i < raw->nvox; i++){
+      fvol->data[i] = (float)raw->labels[i];
+      if(raw->labels[i] > max){
+         max = raw->labels[i];
+         }
+      }
+   if(max > (1U << FLT_MANT_DIG)){
+      fprintf(stderr, "labels_to_float(): labels above %d are not exact as floats\n",
+              1 << FLT_MANT_DIG);
+      }
+
+   delete_raw_volume(raw);
+   return fvol;
+   }
+
+/* returns a full copy of a Raw_volume */
+Raw_volume *copy_raw_volume(Raw_volume * raw)
+{
+   Raw_volume *copy;
+
+   if(raw->type == RAW_LABEL){
+      copy = new_label_volume(raw->sizes);
+      memcpy(copy->labels, raw->labels, raw->nvox * sizeof(unsigned int));
+      return copy;
+      }
+
+   copy = new_raw_volume(raw->sizes);
+   memcpy(copy->data, raw->data, raw->nvox * sizeof(float));
+
+   return copy;
+   }
+
+void delete_raw_volume(Raw_volume * raw)
+{
+   free(raw->data);
+   free(raw->labels);
+   free(raw);
+   }
+
+/* the spare volume of the ping-pong pair, NULL if it is in use */
+static Raw_volume *raw_pool = NULL;
+
+/* allocate the spare of the pool up front, the same size as raw */
+void init_raw_pool(Raw_volume * raw)
+{
+   release_raw_volume(get_spare_raw_volume(raw));
+   }
+
+/* take the spare out of the pool, or a new volume if the pool has */
+/* none of the same size.  The contents are undefined              */
+Raw_volume *get_spare_raw_volume(Raw_volume * raw)
+{
+   Raw_volume *spare;
+
+   if(raw_pool != NULL && raw_pool->sizes[0] == raw->sizes[0] &&
+      raw_pool->sizes[1] == raw->sizes[1] && raw_pool->sizes[2] == raw->sizes[2]){
+      spare = raw_pool;
+      raw_pool = NULL;
+      return spare;
+      }
+
+   return new_raw_volume(raw->sizes);
+   }
+
+/* hand a volume back to the pool, it is freed if the pool is full */
+/* or it holds labels                                               */
+void release_raw_volume(Raw_volume * raw)
+{
+   if(raw_pool == NULL && raw->type == RAW_FLOAT){
+      raw_pool = raw;
+      }
+   else {
+      delete_raw_volume(raw);
+      }
+   }
+
+/* free the spare held by the pool (if any) */
+void empty_raw_pool(void)
+{
+   if(raw_pool != NULL){
+      delete_raw_volume(raw_pool);
+      raw_pool = NULL;
+      }
+   }
+
+/* pull the real values of a volume_io volume into a new Raw_volume */
+Raw_volume *volume_to_raw(VIO_Volume vol)
+{
+   int      sizes[MAX_VAR_DIMS];
+
+   get_volume_sizes(vol, sizes);
+   return volume_slab_to_raw(vol, 0, sizes[0]);
+   }
+
+/* pull the real values of the slices [start, start + n) of a volume_io */
+/* volume into a new Raw_volume of n slices.  This is done a slice at a */
+/* time via the hyperslab routines so a cached volume is never loaded   */
+/* as a whole                                                           */
+Raw_volume *volume_slab_to_raw(VIO_Volume vol, int start, int n)
+{
+   int      z;
+   long     i;
+   int      sizes[MAX_VAR_DIMS];
+   Raw_volume *raw;
+   Real    *slice;
+
+   get_volume_sizes(vol, sizes);
+   sizes[0] = n;
+   raw = new_raw_volume(sizes);
+
+   ALLOC(slice, raw->strides[0]);
+   for(z = 0; z < n; z++){
+      get_volume_value_hyperslab(vol, start + z, 0, 0, 0, 0, 1, sizes[1], sizes[2], 1, 1,
+                                 slice);
+      for(i = 0; i < raw->strides[0]; i++){
+         raw->data[z * raw->strides[0] + i] = (float)slice[i];
+         }
+      }
+   FREE(slice);
+
+   return raw;
+   }
+
+/* hand the real values of a Raw_volume back to a volume_io volume */
+void raw_to_volume(Raw_volume * raw, VIO_Volume vol)
+{
+   raw_slab_to_volume(raw, 0, raw->sizes[0], vol, 0);
+   }
+
+/* hand the real values of the slices [first, first + n) of a Raw_volume */
+/* back to the slices [start, start + n) of a volume_io volume           */
+void raw_slab_to_volume(Raw_volume * raw, int first, int n, VIO_Volume vol, int start)
+{
+   int      z;
+   long     i;
+   Real    *slice;
+
+   ALLOC(slice, raw->strides[0]);
+   for(z = 0; z < n; z++){
+      for(i = 0; i < raw->strides[0]; i++){
+         slice[i] = (raw->type == RAW_LABEL) ? raw->labels[(first + z) * raw->strides[0] + i] :
+            raw->data[(first + z) * raw->strides[0] + i];
+         }
+      set_volume_value_hyperslab(vol, start + z, 0, 0, 0, 0, 1, raw->sizes[1], raw->sizes[2],
+                                 1, 1, slice);
+      }
+   FREE(slice);
+   }
+
+/* find the bounding box [b0, b1) (z, y, x) of the voxels that are not */
+/* value, returns FALSE if there are none                              */
+int raw_bounding_box(Raw_volume * raw, double value, int b0[], int b1[])
+{
+   int      x, y, z, n;
+   float    bg = (float)value;
+   float   *row;
+
+   for(n = 0; n < 3; n++){
+      b0[n] = raw->sizes[n];
+      b1[n] = 0;
+      }
+
+   for(z = 0; z < raw->sizes[0]; z++){
+      for(y = 0; y < raw->sizes[1]; y++){
+         row = &raw->data[RAW_INDEX(raw, z, y, 0)];
+
+         /* only the ends of a row can move the x extent */
+         for(x = 0; x < raw->sizes[2] && row[x] == bg; x++);
+         if(x == raw->sizes[2]){
+            continue;
+            }
+         if(x < b0[2]){
+            b0[2] = x;
+            }
+         for(x = raw->sizes[2] - 1; row[x] == bg; x--);
+         if(x + 1 > b1[2]){
+            b1[2] = x + 1;
+            }
+
+         if(z < b0[0]){
+            b0[0] = z;
+            }
+         b1[0] = z + 1;
+         if(y < b0[1]){
+            b0[1] = y;
+            }
+         if(y + 1 > b1[1]){
+            b1[1] = y + 1;
+            }
+         }
+      }
+
+   return (b1[0] > b0[0]);
+   }
+
+/* returns a new Raw_volume of the box [b0, b1) (z, y, x) of raw */
+Raw_volume *crop_raw_volume(Raw_volume * raw, int b0[], int b1[])
+{
+   int      y, z;
+   int      sizes[3];
+   Raw_volume *crop;
+
+   sizes[0] = b1[0] - b0[0];
+   sizes[1] = b1[1] - b0[1];
+   sizes[2] = b1[2] - b0[2];
+   crop = new_raw_volume(sizes);
+
+   for(z = 0; z < sizes[0]; z++){
+      for(y = 0; y < sizes[1]; y++){
+         memcpy(&crop->data[RAW_INDEX(crop, z, y, 0)],
+                &raw->data[RAW_INDEX(raw, b0[0] + z, b0[1] + y, b0[2])],
+                sizes[2] * sizeof(float));
+         }
+      }
+
+   return crop;
+   }
+
+/* set raw to value outside the box [b0, b1) (z, y, x) and copy the  */
+/* box in from crop, whose first voxel is at origin in raw            */
+void paste_raw_volume(Raw_volume * crop, int origin[], Raw_volume * raw, int b0[], int b1[],
+                      double value)
+{
+   int      x, y, z;
+   long     row;
+   float    bg = (float)value;
+
+   for(z = 0; z < raw->sizes[0]; z++){
+      for(y = 0; y < raw->sizes[1]; y++){
+         row = RAW_INDEX(raw, z, y, 0);
+         if(z < b0[0] || z >= b1[0] || y < b0[1] || y >= b1[1]){
+            for(x = 0; x < raw->sizes[2]; x++){
+               raw->data[row + x] = bg;
+               }
+            continue;
+            }
+
+         for(x = 0; x < b0[2]; x++){
+            raw->data[row + x] = bg;
+            }
+         memcpy(&raw->data[row + b0[2]],
+                &crop->data[RAW_INDEX(crop, z - origin[0], y - origin[1], b0[2] - origin[2])],
+                (b1[2] - b0[2]) * sizeof(float));
+         for(x = b1[2]; x < raw->sizes[2]; x++){
+            raw->data[row + x] = bg;
+            }
+         }
+      }
+   }
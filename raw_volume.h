@@ -0,0 +1,89 @@
+/* raw_volume.h */
+
+#ifndef RAW_VOLUME
+#define RAW_VOLUME
+
+#include <volume_io.h>
+
+/* what the voxels of a Raw_volume are, the ops work on floats and */
+/* labels are kept as unsigned ints until an op needs floats        */
+typedef enum {
+   RAW_FLOAT, RAW_LABEL
+   } raw_types;
+
+/* Structure for a volume held as one contiguous array   */
+/* voxels are stored z, y, x with x varying fastest      */
+typedef struct {
+   int      sizes[3];
+   long     strides[3];
+   long     nvox;
+   raw_types type;
+   float   *data;                      /* RAW_FLOAT voxels */
+   unsigned int *labels;               /* RAW_LABEL voxels */
+   } Raw_volume;
+
+/* linear index of the voxel at z, y, x */
+#define RAW_INDEX(raw, z, y, x) \
+   ((long)(z) * (raw)->strides[0] + (long)(y) * (raw)->strides[1] + (long)(x))
+
+/* returns a new (uninitialised) Raw_volume of the given z, y, x sizes */
+Raw_volume *new_raw_volume(int sizes[]);
+
+/* returns a new label volume of the given z, y, x sizes, all 0 */
+Raw_volume *new_label_volume(int sizes[]);
+
+/* hand back a label volume as floats (a float volume as it is), */
+/* labels above 2^24 are not exact                               */
+Raw_volume *labels_to_float(Raw_volume * raw);
+
+/* returns a full copy of a Raw_volume */
+Raw_volume *copy_raw_volume(Raw_volume * raw);
+
+/* free a Raw_volume and its data */
+void     delete_raw_volume(Raw_volume * raw);
+
+/* the ops write their result into a spare volume and hand their  */
+/* source back to a pool of one, so a chain of ops ping-pongs      */
+/* between two buffers rather than copying the volume for each op  */
+
+/* allocate the spare of the pool up front, the same size as raw */
+void     init_raw_pool(Raw_volume * raw);
+
+/* take the spare out of the pool, or a new volume if the pool has */
+/* none of the same size.  The contents are undefined              */
+Raw_volume *get_spare_raw_volume(Raw_volume * raw);
+
+/* hand a volume back to the pool, it is freed if the pool is full */
+/* or it holds labels                                               */
+void     release_raw_volume(Raw_volume * raw);
+
+/* free the spare held by the pool (if any) */
+void     empty_raw_pool(void);
+
+/* pull the real values of a volume_io volume into a new Raw_volume */
+Raw_volume *volume_to_raw(VIO_Volume vol);
+
+/* pull the real values of the slices [start, start + n) of a */
+/* volume_io volume into a new Raw_volume of n slices          */
+Raw_volume *volume_slab_to_raw(VIO_Volume vol, int start, int n);
+
+/* hand the real values of a Raw_volume back to a volume_io volume */
+void     raw_to_volume(Raw_volume * raw, VIO_Volume vol);
+
+/* hand the real values of the slices [first, first + n) of a Raw_volume */
+/* back to the slices [start, start + n) of a volume_io volume           */
+void     raw_slab_to_volume(Raw_volume * raw, int first, int n, VIO_Volume vol, int start);
+
+/* find the bounding box [b0, b1) (z, y, x) of the voxels that are not */
+/* value, returns FALSE if there are none                              */
+int      raw_bounding_box(Raw_volume * raw, double value, int b0[], int b1[]);
+
+/* returns a new Raw_volume of the box [b0, b1) (z, y, x) of raw */
+Raw_volume *crop_raw_volume(Raw_volume * raw, int b0[], int b1[]);
+
+/* set raw to value outside the box [b0, b1) (z, y, x) and copy the  */
+/* box in from crop, whose first voxel is at origin in raw            */
+void     paste_raw_volume(Raw_volume * crop, int origin[], Raw_volume * raw, int b0[],
+                          int b1[], double value);
+
+#endif
@@ -0,0 +1,299 @@
+/* row_ops.c - row kernels for the erosion, dilation, median and     */
+/* convolution inner loops.  Vector versions are compiled for SSE2, AVX2 and      */
+/* AVX-512 and picked at run time, all of them give the same result   */
+/* as the scalar loops (min/max keep the operand order of the         */
+/* comparison and convolution does not fuse the multiply and add)     */
+
+#include "row_ops.h"
+
+#if defined(__GNUC__) && (__GNUC__ >= 5) && (defined(__x86_64__) || defined(__i386__))
+#define ROW_OPS_X86
+#include <immintrin.h>
+#endif
+
+static void row_min_scalar(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i < n; i++){
+      out[i] = (x[i] < y[i]) ? x[i] : y[i];
+      }
+   }
+
+static void row_max_scalar(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i < n; i++){
+      out[i] = (x[i] > y[i]) ? x[i] : y[i];
+      }
+   }
+
+static void row_minmax_scalar(float *lo, float *hi, long n)
+{
+   long     i;
+   float    a, b;
+
+   for(i = 0; i < n; i++){
+      a = lo[i];
+      b = hi[i];
+      lo[i] = (a < b) ? a : b;
+      hi[i] = (a > b) ? a : b;
+      }
+   }
+
+static void row_add_scalar(double *acc, const float *src, long n)
+{
+   long     i;
+
+   for(i = 0; i < n; i++){
+      acc[i] += src[i];
+      }
+   }
+
+static void row_madd_scalar(double *acc, const float *src, double coeff, long n)
+{
+   long     i;
+
+   for(i = 0; i < n; i++){
+      acc[i] += src[i] * coeff;
+      }
+   }
+
+void     (*row_min) (float *out, const float *x, const float *y, long n) = row_min_scalar;
+void     (*row_max) (float *out, const float *x, const float *y, long n) = row_max_scalar;
+void     (*row_minmax) (float *lo, float *hi, long n) = row_minmax_scalar;
+void     (*row_add) (double *acc, const float *src, long n) = row_add_scalar;
+void     (*row_madd) (double *acc, const float *src, double coeff, long n) = row_madd_scalar;
+
+#ifdef ROW_OPS_X86
+
+/* minps/maxps return the second operand unless the comparison of the */
+/* first with the second holds, just like the scalar ?: above         */
+
+/* --- SSE2 */
+__attribute__ ((target("sse2")))
+static void row_min_sse2(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i + 4 <= n; i += 4){
+      _mm_storeu_ps(&out[i], _mm_min_ps(_mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i])));
+      }
+   row_min_scalar(&out[i], &x[i], &y[i], n - i);
+   }
+
+__attribute__ ((target("sse2")))
+static void row_max_sse2(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i + 4 <= n; i += 4){
+      _mm_storeu_ps(&out[i], _mm_max_ps(_mm_loadu_ps(&x[i]), _mm_loadu_ps(&y[i])));
+      }
+   row_max_scalar(&out[i], &x[i], &y[i], n - i);
+   }
+
+__attribute__ ((target("sse2")))
+static void row_minmax_sse2(float *lo, float *hi, long n)
+{
+   long     i;
+   __m128   a, b;
+
+   for(i = 0; i + 4 <= n; i += 4){
+      a = _mm_loadu_ps(&lo[i]);
+      b = _mm_loadu_ps(&hi[i]);
+      _mm_storeu_ps(&lo[i], _mm_min_ps(a, b));
+      _mm_storeu_ps(&hi[i], _mm_max_ps(a, b));
+      }
+   row_minmax_scalar(&lo[i], &hi[i], n - i);
+   }
+
+__attribute__ ((target("sse2")))
+static void row_add_sse2(double *acc, const float *src, long n)
+{
+   long     i;
+   __m128   s;
+
+   for(i = 0; i + 4 <= n; i += 4){
+      s = _mm_loadu_ps(&src[i]);
+      _mm_storeu_pd(&acc[i], _mm_add_pd(_mm_loadu_pd(&acc[i]), _mm_cvtps_pd(s)));
+      _mm_storeu_pd(&acc[i + 2], _mm_add_pd(_mm_loadu_pd(&acc[i + 2]),
+                                            _mm_cvtps_pd(_mm_movehl_ps(s, s))));
+      }
+   row_add_scalar(&acc[i], &src[i], n - i);
+   }
+
+__attribute__ ((target("sse2")))
+static void row_madd_sse2(double *acc, const float *src, double coeff, long n)
+{
+   long     i;
+   __m128   s;
+   __m128d  c;
+
+   c = _mm_set1_pd(coeff);
+   for(i = 0; i + 4 <= n; i += 4){
+      s = _mm_loadu_ps(&src[i]);
+      _mm_storeu_pd(&acc[i], _mm_add_pd(_mm_loadu_pd(&acc[i]),
+                                        _mm_mul_pd(_mm_cvtps_pd(s), c)));
+      _mm_storeu_pd(&acc[i + 2], _mm_add_pd(_mm_loadu_pd(&acc[i + 2]),
+                                            _mm_mul_pd(_mm_cvtps_pd(_mm_movehl_ps(s, s)),
+                                                       c)));
+      }
+   row_madd_scalar(&acc[i], &src[i], coeff, n - i);
+   }
+
+/* --- AVX2 */
+__attribute__ ((target("avx2")))
+static void row_min_avx2(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i + 8 <= n; i += 8){
+      _mm256_storeu_ps(&out[i], _mm256_min_ps(_mm256_loadu_ps(&x[i]),
+                                              _mm256_loadu_ps(&y[i])));
+      }
+   row_min_scalar(&out[i], &x[i], &y[i], n - i);
+   }
+
+__attribute__ ((target("avx2")))
+static void row_max_avx2(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i + 8 <= n; i += 8){
+      _mm256_storeu_ps(&out[i], _mm256_max_ps(_mm256_loadu_ps(&x[i]),
+                                              _mm256_loadu_ps(&y[i])));
+      }
+   row_max_scalar(&out[i], &x[i], &y[i], n - i);
+   }
+
+__attribute__ ((target("avx2")))
+static void row_minmax_avx2(float *lo, float *hi, long n)
+{
+   long     i;
+   __m256   a, b;
+
+   for(i = 0; i + 8 <= n; i += 8){
+      a = _mm256_loadu_ps(&lo[i]);
+      b = _mm256_loadu_ps(&hi[i]);
+      _mm256_storeu_ps(&lo[i], _mm256_min_ps(a, b));
+      _mm256_storeu_ps(&hi[i], _mm256_max_ps(a, b));
+      }
+   row_minmax_scalar(&lo[i], &hi[i], n - i);
+   }
+
+__attribute__ ((target("avx2")))
+static void row_add_avx2(double *acc, const float *src, long n)
+{
+   long     i;
+
+   for(i = 0; i + 4 <= n; i += 4){
+      _mm256_storeu_pd(&acc[i], _mm256_add_pd(_mm256_loadu_pd(&acc[i]),
+                                              _mm256_cvtps_pd(_mm_loadu_ps(&src[i]))));
+      }
+   row_add_scalar(&acc[i], &src[i], n - i);
+   }
+
+__attribute__ ((target("avx2")))
+static void row_madd_avx2(double *acc, const float *src, double coeff, long n)
+{
+   long     i;
+   __m256d  c;
+
+   c = _mm256_set1_pd(coeff);
+   for(i = 0; i + 4 <= n; i += 4){
+      _mm256_storeu_pd(&acc[i], _mm256_add_pd(_mm256_loadu_pd(&acc[i]),
+                                              _mm256_mul_pd(_mm256_cvtps_pd
+                                                            (_mm_loadu_ps(&src[i])), c)));
+      }
+   row_madd_scalar(&acc[i], &src[i], coeff, n - i);
+   }
+
+/* --- AVX-512, only for min/max as the convolution rows would */
+/* leave the multiply and add open to contraction into an FMA  */
+__attribute__ ((target("avx512f")))
+static void row_min_avx512(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i + 16 <= n; i += 16){
+      _mm512_storeu_ps(&out[i], _mm512_min_ps(_mm512_loadu_ps(&x[i]),
+                                              _mm512_loadu_ps(&y[i])));
+      }
+   row_min_scalar(&out[i], &x[i], &y[i], n - i);
+   }
+
+__attribute__ ((target("avx512f")))
+static void row_max_avx512(float *out, const float *x, const float *y, long n)
+{
+   long     i;
+
+   for(i = 0; i + 16 <= n; i += 16){
+      _mm512_storeu_ps(&out[i], _mm512_max_ps(_mm512_loadu_ps(&x[i]),
+                                              _mm512_loadu_ps(&y[i])));
+      }
+   row_max_scalar(&out[i], &x[i], &y[i], n - i);
+   }
+
+__attribute__ ((target("avx512f")))
+static void row_minmax_avx512(float *lo, float *hi, long n)
+{
+   long     i;
+   __m512   a, b;
+
+   for(i = 0; i + 16 <= n; i += 16){
+      a = _mm512_loadu_ps(&lo[i]);
+      b = _mm512_loadu_ps(&hi[i]);
+      _mm512_storeu_ps(&lo[i], _mm512_min_ps(a, b));
+      _mm512_storeu_ps(&hi[i], _mm512_max_ps(a, b));
+      }
+   row_minmax_scalar(&lo[i], &hi[i], n - i);
+   }
+
+#endif
+
+/* pick the widest row kernels the CPU supports, or the scalar */
+/* ones if use_simd is FALSE.  Returns the name of the set used */
+const char *init_row_ops(int use_simd)
+{
+   row_min = row_min_scalar;
+   row_max = row_max_scalar;
+   row_minmax = row_minmax_scalar;
+   row_add = row_add_scalar;
+   row_madd = row_madd_scalar;
+
+   if(!use_simd){
+      return "scalar";
+      }
+
+#ifdef ROW_OPS_X86
+   __builtin_cpu_init();
+   if(__builtin_cpu_supports("avx512f")){
+      row_min = row_min_avx512;
+      row_max = row_max_avx512;
+      row_minmax = row_minmax_avx512;
+      row_add = row_add_avx2;
+      row_madd = row_madd_avx2;
+      return "AVX-512";
+      }
+   if(__builtin_cpu_supports("avx2")){
+      row_min = row_min_avx2;
+      row_max = row_max_avx2;
+      row_minmax = row_minmax_avx2;
+      row_add = row_add_avx2;
+      row_madd = row_madd_avx2;
+      return "AVX2";
+      }
+   if(__builtin_cpu_supports("sse2")){
+      row_min = row_min_sse2;
+      row_max = row_max_sse2;
+      row_minmax = row_minmax_sse2;
+      row_add = row_add_sse2;
+      row_madd = row_madd_sse2;
+      return "SSE2";
+      }
+#endif
+
+   return "scalar";
+   }
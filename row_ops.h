@@ -0,0 +1,25 @@
+/* row_ops.h */
+
+#ifndef ROW_OPS
+#define ROW_OPS
+
+/* out[i] = (x[i] < y[i]) ? x[i] : y[i] */
+extern void (*row_min) (float *out, const float *x, const float *y, long n);
+
+/* out[i] = (x[i] > y[i]) ? x[i] : y[i] */
+extern void (*row_max) (float *out, const float *x, const float *y, long n);
+
+/* lo[i], hi[i] = min, max of lo[i] and hi[i] (a compare-exchange) */
+extern void (*row_minmax) (float *lo, float *hi, long n);
+
+/* acc[i] += src[i] */
+extern void (*row_add) (double *acc, const float *src, long n);
+
+/* acc[i] += src[i] * coeff (as a separate multiply and add) */
+extern void (*row_madd) (double *acc, const float *src, double coeff, long n);
+
+/* pick the widest row kernels the CPU supports, or the scalar */
+/* ones if use_simd is FALSE.  Returns the name of the set used */
+const char *init_row_ops(int use_simd);
+
+#endif
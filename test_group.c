@@ -0,0 +1,73 @@
+/* test_group.c - regression cases for the group labelling */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <volume_io.h>
+#include "kernel_io.h"
+#include "kernel_ops.h"
+#include "raw_volume.h"
+#include "threads.h"
+#include "row_ops.h"
+
+int      verbose = FALSE;
+int      n_threads = 1;
+
+/* label a volume with the 3D26 kernel, returns the number of groups */
+static int count_groups(Raw_volume * vol)
+{
+   Kernel  *kernel;
+   long     i;
+   int      n_groups;
+
+   kernel = get_3D26_kernel();
+   setup_pad_values(kernel);
+   compile_kernel(kernel, vol->strides);
+
+   init_raw_pool(vol);
+   vol = group_kernel(kernel, vol, 0.0, 0, 0, NULL, NULL);
+
+   n_groups = 0;
+   for(i = 0; i < vol->nvox; i++){
+      if(vol->labels[i] > n_groups){
+         n_groups = (int)vol->labels[i];
+         }
+      }
+
+   delete_raw_volume(vol);
+   empty_raw_pool();
+   delete_kernel(kernel);
+   return n_groups;
+   }
+
+int main(int argc, char *argv[])
+{
+   int      sizes[3] = { 5, 6, 7 };
+   int      n, failed;
+   long     i;
+   Raw_volume *vol;
+
+   init_row_ops(TRUE);
+
+   /* the voxel is only joined to the ends of the next row of the    */
+   /* previous slice through the one above it, the ends don't touch  */
+   /* each other and the middle of the row is empty                  */
+   failed = FALSE;
+   for(n_threads = 1; n_threads <= 2; n_threads++){
+      vol = new_raw_volume(sizes);
+      for(i = 0; i < vol->nvox; i++){
+         vol->data[i] = 0.0;
+         }
+      vol->data[RAW_INDEX(vol, 2, 2, 3)] = 1.0;
+      vol->data[RAW_INDEX(vol, 2, 1, 3)] = 1.0;
+      vol->data[RAW_INDEX(vol, 1, 3, 2)] = 1.0;
+      vol->data[RAW_INDEX(vol, 1, 3, 4)] = 1.0;
+
+      n = count_groups(vol);
+      if(n != 1){
+         fprintf(stderr, "%s: %d thread(s) found %d groups, not 1\n", argv[0], n_threads, n);
+         failed = TRUE;
+         }
+      }
+
+   return (failed) ? EXIT_FAILURE : EXIT_SUCCESS;
+   }
@@ -0,0 +1,67 @@
+/* threads.c - split work over z-slabs on several threads */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "threads.h"
+
+/* structure for the arguments of one slab */
+typedef struct {
+   Slab_func func;
+   void    *arg;
+   int      start;
+   int      stop;
+   int      thread;
+   } slab_struct;
+
+static void *run_slab(void *ptr)
+{
+   slab_struct *slab = (slab_struct *) ptr;
+
+   slab->func(slab->arg, slab->start, slab->stop, slab->thread);
+   return NULL;
+   }
+
+/* split [start, stop) into one contiguous slab per thread and */
+/* run func on each slab concurrently, returns once all finish */
+void run_slabs(Slab_func func, void *arg, int start, int stop)
+{
+   int      t, nt;
+   pthread_t *threads;
+   slab_struct *slabs;
+
+   /* nothing to share out */
+   nt = (n_threads < stop - start) ? n_threads : stop - start;
+   if(nt <= 1){
+      if(stop > start){
+         func(arg, start, stop, 0);
+         }
+      return;
+      }
+
+   threads = (pthread_t *) malloc(nt * sizeof(pthread_t));
+   slabs = (slab_struct *) malloc(nt * sizeof(slab_struct));
+
+   for(t = 0; t < nt; t++){
+      slabs[t].func = func;
+      slabs[t].arg = arg;
+      slabs[t].start = start + (int)((long)(stop - start) * t / nt);
+      slabs[t].stop = start + (int)((long)(stop - start) * (t + 1) / nt);
+      slabs[t].thread = t;
+      }
+
+   /* the first slab is run by the calling thread */
+   for(t = 1; t < nt; t++){
+      if(pthread_create(&threads[t], NULL, run_slab, &slabs[t]) != 0){
+         fprintf(stderr, "run_slabs(): failed to start thread %d\n", t);
+         exit(EXIT_FAILURE);
+         }
+      }
+   run_slab(&slabs[0]);
+   for(t = 1; t < nt; t++){
+      pthread_join(threads[t], NULL);
+      }
+
+   free(threads);
+   free(slabs);
+   }
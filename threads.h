@@ -0,0 +1,17 @@
+/* threads.h */
+
+#ifndef THREADS
+#define THREADS
+
+/* number of threads to split the operations over */
+extern int n_threads;
+
+/* a worker is passed its argument, the [start, stop) range */
+/* it is responsible for and the index of its thread         */
+typedef void (*Slab_func)(void *arg, int start, int stop, int thread);
+
+/* split [start, stop) into one contiguous slab per thread and */
+/* run func on each slab concurrently, returns once all finish */
+void     run_slabs(Slab_func func, void *arg, int start, int stop);
+
+#endif